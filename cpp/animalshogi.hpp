@@ -1,10 +1,16 @@
 #pragma once
 
-#include <set>
 #include <random>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "util.hpp"
 #include "boardgame.hpp"
+#include "symmetry.hpp"
+#include "search.hpp"
+#include "dfpn.hpp"
 
 using namespace std;
 
@@ -44,15 +50,80 @@ namespace AnimalShogi
     };
 
     long long PIECE_KEY[10][B];
+    long long MIRROR_PIECE_KEY[10][B]; // PIECE_KEY of the mirrored square
     long long HAND_KEY[2][4];
 
+    // move tables as 12-bit square masks
+    int STEP_MASK[10][B]; // squares reached by one step of each piece
+    int RAY_MASK[8][B];   // squares on the ray from each square to each direction
+    int SLIDE_DIRS[10];   // bit set of sliding directions of each piece
+
+    inline void init_move_tables() {
+        for (int piece = 0; piece < 10; piece++) {
+            int type = piece % 5, color = piece / 5;
+            SLIDE_DIRS[piece] = 0;
+            for (int d = 0; d < 8; d++) {
+                int dd = color == BLACK ? d : point_symmetry(d);
+                if (LONG[type][dd]) SLIDE_DIRS[piece] |= 1 << d;
+            }
+            for (int pos = 0; pos < B; pos++) {
+                int x = pos % LX, y = pos / LX;
+                STEP_MASK[piece][pos] = 0;
+                for (int d = 0; d < 8; d++) {
+                    int dd = color == BLACK ? d : point_symmetry(d);
+                    int x_to = x + D2[d][0], y_to = y + D2[d][1];
+                    if (SHORT[type][dd] && onboard_xy(x_to, y_to, LX, LY)) {
+                        STEP_MASK[piece][pos] |= 1 << (y_to * LX + x_to);
+                    }
+                }
+            }
+        }
+        for (int d = 0; d < 8; d++) {
+            for (int pos = 0; pos < B; pos++) {
+                RAY_MASK[d][pos] = 0;
+                int x_to = pos % LX, y_to = pos / LX;
+                while (true) {
+                    x_to += D2[d][0];
+                    y_to += D2[d][1];
+                    if (!onboard_xy(x_to, y_to, LX, LY)) break;
+                    RAY_MASK[d][pos] |= 1 << (y_to * LX + x_to);
+                }
+            }
+        }
+    }
+
+    inline int attack_mask(int piece, int pos, int occupied) {
+        int mask = STEP_MASK[piece][pos];
+        for (int dirs = SLIDE_DIRS[piece]; dirs; dirs &= dirs - 1) {
+            int d = bsf(dirs);
+            int ray = RAY_MASK[d][pos];
+            int blockers = ray & occupied;
+            if (blockers) {
+                // squares increase along the ray when the step goes forward in memory
+                bool forward = D2[d][1] * LX + D2[d][0] > 0;
+                int first = forward ? bsf(blockers) : bsr(blockers);
+                ray &= ~RAY_MASK[d][first];
+            }
+            mask |= ray;
+        }
+        return mask;
+    }
+
     inline void init() {
+        init_move_tables();
         mt19937_64 mt(0);
         for (int p = 0; p < 10; p++) {
             for (int pos = 0; pos < B; pos++) {
                 PIECE_KEY[p][pos] = mt();
             }
         }
+        for (int p = 0; p < 10; p++) {
+            for (int pos = 0; pos < B; pos++) {
+                // files run along y
+                int x = pos % LX, y = pos / LX;
+                MIRROR_PIECE_KEY[p][pos] = PIECE_KEY[p][x + (LY - 1 - y) * LX];
+            }
+        }
         for (int c = 0; c < 2; c++) {
             for (int type = 0; type < 4; type++) {
                 HAND_KEY[c][type] = mt();
@@ -64,12 +135,25 @@ namespace AnimalShogi
     {
         array<int, B> board_;
         array<array<int, 4>, 2> hand_;
+        array<int, 2> occupancy_; // square mask of pieces of each color
         int color_;
         long long key_;
-        set<long long> keys_;
+        long long mirror_key_; // key_ of the mirrored position
+        KeyHistory keys_;
         vector<int> captured_;
+        vector<bool> promoted_;
         vector<int> record_;
 
+        // plain memory snapshot of a position with the latest keys for repetition;
+        // the record and what undo() needs are left out
+        struct Position
+        {
+            array<int8_t, B> board_;
+            array<array<int8_t, 4>, 2> hand_;
+            int8_t color_;
+            FixedVector<long long, 32> keys_;
+        };
+
         State()
         {
             clear();
@@ -78,10 +162,13 @@ namespace AnimalShogi
         State(const State& s):
         board_(s.board_),
         hand_(s.hand_),
+        occupancy_(s.occupancy_),
         color_(s.color_),
         key_(s.key_),
+        mirror_key_(s.mirror_key_),
         keys_(s.keys_),
         captured_(s.captured_),
+        promoted_(s.promoted_),
         record_(s.record_) {}
 
         array<int, 2> size() const
@@ -99,26 +186,135 @@ namespace AnimalShogi
                         int piece = C.find(piece_char);
                         int pos = xy2position(x, y);
                         board_[pos] = piece;
+                        occupancy_[piece2color(piece)] |= 1 << pos;
                         key_ += PIECE_KEY[piece][pos];
+                        mirror_key_ += MIRROR_PIECE_KEY[piece][pos];
                     }
                 }
             }
         }
 
+        void set_position(const array<int, B>& board, const array<array<int, 4>, 2>& hand, int color)
+        {
+            clear();
+            board_ = board;
+            hand_ = hand;
+            color_ = color;
+            occupancy_.fill(0);
+            key_ = 0;
+            mirror_key_ = 0;
+            for (int pos = 0; pos < B; pos++) {
+                int piece = board_[pos];
+                if (piece >= 0) {
+                    occupancy_[piece2color(piece)] |= 1 << pos;
+                    key_ += PIECE_KEY[piece][pos];
+                    mirror_key_ += MIRROR_PIECE_KEY[piece][pos];
+                }
+            }
+            for (int c = 0; c < 2; c++) {
+                for (int type = 0; type < 4; type++) {
+                    key_ += hand_[c][type] * HAND_KEY[c][type];
+                    mirror_key_ += hand_[c][type] * HAND_KEY[c][type];
+                }
+            }
+        }
+
+        Position position() const
+        {
+            Position p;
+            copy(board_.begin(), board_.end(), p.board_.begin());
+            for (int c = 0; c < 2; c++) copy(hand_[c].begin(), hand_[c].end(), p.hand_[c].begin());
+            p.color_ = color_;
+            p.keys_.clear();
+            size_t n = keys_.size(), first = n - min(n, p.keys_.capacity());
+            for (size_t i = first; i < n; i++) p.keys_.push_back(keys_.keys_[i]);
+            return p;
+        }
+
+        bool set_position(const Position& p)
+        {
+            array<int, B> board;
+            array<array<int, 4>, 2> hand;
+            copy(p.board_.begin(), p.board_.end(), board.begin());
+            for (int c = 0; c < 2; c++) copy(p.hand_[c].begin(), p.hand_[c].end(), hand[c].begin());
+            if (!valid_position(board, hand, p.color_) || p.keys_.size() > p.keys_.capacity()) return false;
+            set_position(board, hand, p.color_);
+            for (long long key : p.keys_) keys_.push(key);
+            return true;
+        }
+
         void clear()
         {
             board_.fill(EMPTY);
             for (auto& h : hand_) {
                 h.fill(0);
             }
+            occupancy_.fill(0);
             key_ = 0;
+            mirror_key_ = 0;
             set_sfen(ORIG);
             color_ = BLACK;
             keys_.clear();
             captured_.clear();
+            promoted_.clear();
             record_.clear();
         }
 
+        void serialize(BinaryWriter *w) const
+        {
+            w->write_as<int8_t>(board_);
+            for (const auto& h : hand_) w->write_as<int8_t>(h);
+            w->write(int8_t(color_));
+            keys_.serialize(w);
+            w->write_as<int8_t>(captured_);
+            w->write_as<uint8_t>(promoted_);
+            w->write_as<int16_t>(record_);
+        }
+
+        bool deserialize(BinaryReader *r)
+        {
+            array<int, B> board;
+            array<array<int, 4>, 2> hand;
+            int8_t color;
+            if (!r->read_as<int8_t>(&board)) return false;
+            for (auto& h : hand) {
+                if (!r->read_as<int8_t>(&h)) return false;
+            }
+            if (!r->read(&color) || !valid_position(board, hand, color)) return false;
+            set_position(board, hand, color);
+            if (!keys_.deserialize(r)) return false;
+            if (!r->read_as<int8_t>(&captured_) || !r->read_as<uint8_t>(&promoted_)) return false;
+            if (!r->read_as<int16_t>(&record_)) return false;
+            if (captured_.size() != record_.size() || promoted_.size() != record_.size()) return false;
+            if (keys_.size() < record_.size()) return false;
+            for (size_t i = 0; i < record_.size(); i++) {
+                if (record_[i] < 0 || record_[i] >= (B + 4) * B) return false;
+                if (captured_[i] < EMPTY || captured_[i] >= 10) return false;
+            }
+            return true;
+        }
+
+        bool valid_position(const array<int, B>& board, const array<array<int, 4>, 2>& hand, int color) const
+        {
+            // at most two pieces of each type on the board and in hand
+            if (color != BLACK && color != WHITE) return false;
+            array<int, 4> count = {0, 0, 0, 0};
+            for (int piece : board) {
+                if (piece < EMPTY || piece >= 10) return false;
+                if (piece >= 0) count[piece2type(unpromote(piece))]++;
+            }
+            for (int c = 0; c < 2; c++) {
+                for (int type = 0; type < 4; type++) {
+                    if (hand[c][type] < 0) return false;
+                    count[type] += hand[c][type];
+                }
+            }
+            for (int cnt : count) {
+                if (cnt > 2) return false;
+            }
+            return true;
+        }
+
         int action2from(int action) const
         {
             return action % (B + 4);
@@ -251,21 +447,25 @@ namespace AnimalShogi
         void play(int action)
         {
             assert(legal(action));
-            keys_.insert(key_ ^ color_);
+            keys_.push(key_ ^ color_);
 
             int from = action2from(action), to = action2to(action);
 
             int piece_cap = board_[to];
             if (piece_cap >= 0) {
                 board_[to] = EMPTY;
+                occupancy_[opponent(color_)] ^= 1 << to;
                 key_ -= PIECE_KEY[piece_cap][to];
+                mirror_key_ -= MIRROR_PIECE_KEY[piece_cap][to];
                 int type = piece2type(unpromote(piece_cap));
                 hand_[color_][type] += 1;
                 key_ += HAND_KEY[color_][type];
+                mirror_key_ += HAND_KEY[color_][type];
             }
             captured_.push_back(piece_cap);
 
             int piece = -1;
+            bool promoted = false;
             if (from >= B) { // drop
                 int type = from - B;
                 piece = typecolor2piece(type, color_);
@@ -273,18 +473,25 @@ namespace AnimalShogi
                 assert(hand_[color_][type] > 0);
                 hand_[color_][type] -= 1;
                 key_ -= HAND_KEY[color_][type];
+                mirror_key_ -= HAND_KEY[color_][type];
             } else { // move
                 piece = board_[from];
+                board_[from] = EMPTY;
+                occupancy_[color_] ^= 1 << from;
+                key_ -= PIECE_KEY[piece][from];
+                mirror_key_ -= MIRROR_PIECE_KEY[piece][from];
+
                 if (position2x(to) == (color_ == BLACK ? 0 : (LX - 1))) {
+                    promoted = piece2type(piece) == CHICK;
                     piece = promote(piece);
                 }
-
-                board_[from] = EMPTY;
-                key_ -= PIECE_KEY[piece][from];
             }
 
             board_[to] = piece;
+            occupancy_[color_] |= 1 << to;
             key_ += PIECE_KEY[piece][to];
+            mirror_key_ += MIRROR_PIECE_KEY[piece][to];
+            promoted_.push_back(promoted);
 
             color_ = opponent(color_);
             record_.push_back(action);
@@ -303,22 +510,28 @@ namespace AnimalShogi
             int piece = board_[to];
 
             board_[to] = EMPTY;
+            occupancy_[color_] ^= 1 << to;
             key_ -= PIECE_KEY[piece][to];
+            mirror_key_ -= MIRROR_PIECE_KEY[piece][to];
 
             if (from >= B) { // drop
                 int type = from - B;
                 hand_[color_][type] += 1;
                 key_ += HAND_KEY[color_][type];
+                mirror_key_ += HAND_KEY[color_][type];
             } else { // move
-                piece = board_[from];
-                if (position2x(from) != (color_ == BLACK ? 0 : (LX - 1))) {
+                if (promoted_.back()) {
                     piece = unpromote(piece);
                 }
 
                 board_[from] = piece;
+                occupancy_[color_] |= 1 << from;
                 key_ += PIECE_KEY[piece][from];
+                mirror_key_ += MIRROR_PIECE_KEY[piece][from];
             }
 
+            promoted_.pop_back();
+
             assert(!captured_.empty());
             int piece_cap = captured_.back();
             captured_.pop_back();
@@ -327,11 +540,14 @@ namespace AnimalShogi
                 assert(hand_[color_][type] > 0);
                 hand_[color_][type] -= 1;
                 key_ -= HAND_KEY[color_][type];
+                mirror_key_ -= HAND_KEY[color_][type];
                 board_[to] = piece_cap;
+                occupancy_[opponent(color_)] |= 1 << to;
                 key_ += PIECE_KEY[piece_cap][to];
+                mirror_key_ += MIRROR_PIECE_KEY[piece_cap][to];
             }
 
-            keys_.erase(key_ ^ color_);
+            keys_.pop();
         }
 
         void plays(const string& s)
@@ -376,62 +592,30 @@ namespace AnimalShogi
                 if (board_[from] < 0) return false;
             }
             int to = action2to(action);
-            if (board_[to] >= 0 && piece2color(board_[to]) == color_) return false;
+            if (occupancy_[color_] >> to & 1) return false;
             return true;
         }
 
         vector<int> legal_actions() const
         {
             vector<int> actions;
+            int occupied = occupancy_[BLACK] | occupancy_[WHITE];
 
             // move actions
-            for (int from = 0; from < B; from++) {
-                int piece = board_[from];
-                if (piece >= 0 && piece2color(piece) == color_) {
-                    // find movable points
-                    int type = piece2type(piece);
-                    int x = position2x(from), y = position2y(from);
-                    // short
-                    for (int d = 0; d < 8; d++) {
-                        int dd = color_ == BLACK ? d : point_symmetry(d);
-                        if (SHORT[type][dd]) {
-                            int x_to = x + D2[d][0], y_to = y + D2[d][1];
-                            if (onboard_xy(x_to, y_to, LX, LY)) {
-                                int to = xy2position(x_to, y_to);
-                                int piece_cap = board_[to];
-                                if (piece_cap < 0 || piece2color(piece_cap) != color_) {
-                                    actions.push_back(fromto2action(from, to));
-                                }
-                            }
-                        }
-                    }
-                    // long
-                    for (int d = 0; d < 8; d++) {
-                        int dd = color_ == BLACK ? d : point_symmetry(d);
-                        if (LONG[type][dd]) {
-                            int x_to = x, y_to = y;
-                            while (true) {
-                                x_to += D2[d][0];
-                                y_to += D2[d][1];
-                                if (!onboard_xy(x_to, y_to, LX, LY)) break;
-                                int to = xy2position(x_to, y_to);
-                                int piece_cap = board_[to];
-                                if (piece_cap >= 0 && piece2color(piece_cap) == color_) break;
-                                actions.push_back(fromto2action(from, to));
-                                if (piece_cap >= 0) break;
-                            }
-                        }
-                    }
+            for (int froms = occupancy_[color_]; froms; froms &= froms - 1) {
+                int from = bsf(froms);
+                int targets = attack_mask(board_[from], from, occupied) & ~occupancy_[color_];
+                for (; targets; targets &= targets - 1) {
+                    actions.push_back(fromto2action(from, bsf(targets)));
                 }
             }
 
             // drop actions
+            int empties = ~occupied & ((1 << B) - 1);
             for (int type = 0; type < 4; type++) {
                 if (hand_[color_][type] > 0) {
-                    for (int to = 0; to < B; to++) {
-                        if (board_[to] < 0) {
-                            actions.push_back(fromto2action(B + type, to));
-                        }
+                    for (int tos = empties; tos; tos &= tos - 1) {
+                        actions.push_back(fromto2action(B + type, bsf(tos)));
                     }
                 }
             }
@@ -439,14 +623,74 @@ namespace AnimalShogi
             return actions;
         }
 
+        long long key() const
+        {
+            return key_ ^ color_;
+        }
+
+        pair<long long, int> canonical_hash() const
+        {
+            // a key shared by mirrored positions and the symmetry to the canonical one
+            array<long long, 2> keys = {key_ ^ color_, mirror_key_ ^ color_};
+            return smallest_key(keys.data(), 2);
+        }
+
+        pair<int, vector<int>> mate_search(long long max_nodes) const
+        {
+            // result (1 win, -1 no forced win, 0 unknown) and proof line
+            DFPN<State> solver;
+            State s(*this);
+            int result = solver.search(s, max_nodes);
+            vector<int> line;
+            if (result > 0) line = solver.proof_line(s);
+            return make_pair(result, line);
+        }
+
+        pair<float, int> tablebase_value() const;
+        pair<vector<int>, float> best_actions() const;
+
         int action_length() const
         {
             return (B + 4) * B;
         }
 
+        int symmetry_count() const
+        {
+            return 2; // mirror of files
+        }
+
+        int transform_position(int sym, int pos) const
+        {
+            // files run along y
+            int x = position2x(pos), y = position2y(pos);
+            transform_xy(sym ? 2 : 0, LX, LY, &x, &y);
+            return xy2position(x, y);
+        }
+
+        int transform_action(int sym, int action) const
+        {
+            // pieces in hand (from >= B) stay
+            int from = action2from(action), to = action2to(action);
+            if (from < B) from = transform_position(sym, from);
+            return fromto2action(from, transform_position(sym, to));
+        }
+
+        int feature_channels() const
+        {
+            return 27;
+        }
+
         vector<float> feature() const
         {
-            vector<float> f(27 * LX * LY, 0.0f);
+            vector<float> f(feature_channels() * B);
+            feature_into(f.data());
+            return f;
+        }
+
+        void feature_into(float *f) const
+        {
+            // feature_channels() planes written into f
+            fill(f, f + 27 * B, 0.0f);
             // board
             for (int pos = 0; pos < B; pos++) {
                 int piece = board_[pos];
@@ -475,7 +719,225 @@ namespace AnimalShogi
                     f[26 * B + pos] = 1;
                 }
             }
-            return f;
         }
     };
-}
+
+    static_assert(is_trivially_copyable<State::Position>::value, "AnimalShogi::State::Position must be plain memory");
+
+    // solved game values
+    // positions are stored with the side to move as black (otherwise rotated),
+    // keyed by 4 bits per square and 2 bits per hand count,
+    // and grouped into hashed buckets so that a probe scans only a few entries
+
+    struct Tablebase
+    {
+        enum { DRAW, WIN, LOSS };
+
+        struct Header
+        {
+            char magic_[8];
+            unsigned long long size_;
+            int bucket_bits_;
+            int reserved_;
+        };
+
+        static constexpr const char *MAGIC = "ASTB0001";
+        static constexpr int HAND_SHIFT = 4 * B;
+
+        const Header *header_;
+        const unsigned long long *buckets_;
+        const unsigned long long *keys_;
+        const unsigned short *values_;
+        void *map_;
+        size_t map_size_;
+
+        Tablebase(): header_(nullptr), map_(nullptr), map_size_(0) {}
+        ~Tablebase() { close(); }
+
+        static unsigned long long encode(const State& s)
+        {
+            // 0 for positions out of the table (lion in hand)
+            if (s.hand_[BLACK][LION] > 0 || s.hand_[WHITE][LION] > 0) return 0;
+            bool rotate = s.color_ == WHITE;
+            unsigned long long key = 0;
+            for (int pos = 0; pos < B; pos++) {
+                int piece = s.board_[pos];
+                if (piece < 0) continue;
+                if (rotate) piece = (piece + 5) % 10;
+                key |= (unsigned long long)(piece + 1) << (4 * (rotate ? B - 1 - pos : pos));
+            }
+            for (int c = 0; c < 2; c++) {
+                for (int type = GIRRAFE; type <= CHICK; type++) {
+                    int shift = HAND_SHIFT + (c * 3 + type - 1) * 2;
+                    key |= (unsigned long long)s.hand_[rotate ? opponent(c) : c][type] << shift;
+                }
+            }
+            return key;
+        }
+
+        static void decode(unsigned long long key, State *s)
+        {
+            array<int, B> board;
+            array<array<int, 4>, 2> hand;
+            for (int pos = 0; pos < B; pos++) {
+                board[pos] = int((key >> (4 * pos)) & 15) - 1;
+            }
+            for (int c = 0; c < 2; c++) {
+                hand[c][LION] = 0;
+                for (int type = GIRRAFE; type <= CHICK; type++) {
+                    int shift = HAND_SHIFT + (c * 3 + type - 1) * 2;
+                    hand[c][type] = (key >> shift) & 3;
+                }
+            }
+            s->set_position(board, hand, BLACK);
+        }
+
+        static unsigned long long bucket(unsigned long long key, int bits)
+        {
+            return (key * 0x9E3779B97F4A7C15ULL) >> (64 - bits);
+        }
+
+        static unsigned short make_value(int result, int dtm)
+        {
+            return (result << 14) | dtm;
+        }
+
+        static int value2result(unsigned short v) { return v >> 14; }
+        static int value2dtm(unsigned short v) { return v & 0x3fff; }
+
+        bool open(const string& path)
+        {
+            close();
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Header)) {
+                ::close(fd);
+                return false;
+            }
+            void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                std::perror("failed to map tablebase.\n");
+                return false;
+            }
+            map_ = map;
+            map_size_ = st.st_size;
+
+            header_ = (const Header*)map_;
+            // the sections must fit in the file before any pointer into them is used
+            unsigned long long rest = map_size_ - sizeof(Header);
+            int bits = header_->bucket_bits_;
+            bool valid = strncmp(header_->magic_, MAGIC, 8) == 0
+                      && bits >= 1 && bits < 40 && header_->size_ <= rest / 10
+                      && sizeof(unsigned long long) * ((1ULL << bits) + 1) + 10 * header_->size_ <= rest;
+            if (!valid) {
+                cerr << "invalid tablebase " << path << endl;
+                close();
+                return false;
+            }
+            const char *p = (const char*)map_ + sizeof(Header);
+            buckets_ = (const unsigned long long*)p;
+            p += sizeof(unsigned long long) * ((1ULL << header_->bucket_bits_) + 1);
+            keys_ = (const unsigned long long*)p;
+            p += sizeof(unsigned long long) * header_->size_;
+            values_ = (const unsigned short*)p;
+            return true;
+        }
+
+        void close()
+        {
+            if (map_ != nullptr) munmap(map_, map_size_);
+            map_ = nullptr;
+            header_ = nullptr;
+        }
+
+        bool loaded() const
+        {
+            return header_ != nullptr;
+        }
+
+        long long index(unsigned long long key) const
+        {
+            unsigned long long b = bucket(key, header_->bucket_bits_);
+            if (buckets_[b] > buckets_[b + 1] || buckets_[b + 1] > header_->size_) return -1;
+            const unsigned long long *first = keys_ + buckets_[b];
+            const unsigned long long *last  = keys_ + buckets_[b + 1];
+            const unsigned long long *it = lower_bound(first, last, key);
+            if (it == last || *it != key) return -1;
+            return it - keys_;
+        }
+
+        bool probe(const State& s, int *result, int *dtm) const
+        {
+            unsigned long long key = encode(s);
+            if (key == 0) return false;
+            long long i = index(key);
+            if (i < 0) return false;
+            *result = value2result(values_[i]);
+            *dtm = value2dtm(values_[i]);
+            return true;
+        }
+    };
+
+    Tablebase *tablebase = nullptr;
+    once_flag tablebase_once;
+    const int SEARCH_DEPTH = 8; // of the alpha-beta search used without a tablebase
+
+    inline bool open_tablebase(const string& path = "./animalshogi.tb")
+    {
+        if (!tablebase) tablebase = new Tablebase();
+        return tablebase->open(path);
+    }
+
+    inline void load_tablebase()
+    {
+        // the default file is mapped on the first probe, which searches may reach in parallel
+        call_once(tablebase_once, []() {
+            if (!tablebase) open_tablebase();
+        });
+    }
+
+    inline pair<float, int> State::tablebase_value() const
+    {
+        // subjective game value and plies to the end of the game; without a tablebase,
+        // the value of a depth-limited search (0 when unknown) and -1
+        if (terminal()) return make_pair(reward(), 0);
+        load_tablebase();
+        int result, dtm;
+        if (tablebase->loaded() && tablebase->probe(*this, &result, &dtm)) {
+            float v = result == Tablebase::WIN ? 1 : (result == Tablebase::LOSS ? -1 : 0);
+            return make_pair(v, dtm);
+        }
+        return make_pair(alpha_beta_search(*this, SEARCH_DEPTH).second, -1);
+    }
+
+    inline pair<vector<int>, float> State::best_actions() const
+    {
+        load_tablebase();
+        if (!tablebase->loaded()) return alpha_beta_search(*this, SEARCH_DEPTH);
+
+        // prefer faster wins and slower losses
+        float best = -10000;
+        int best_dtm = 0;
+        vector<int> best_actions;
+        State s(*this);
+        for (int action : legal_actions()) {
+            s.play(action);
+            auto value = s.tablebase_value();
+            s.undo();
+            float v = -value.first;
+            int dtm = value.second + 1;
+            bool better = v > best
+                       || (v == best && v > 0 && dtm < best_dtm)
+                       || (v == best && v < 0 && dtm > best_dtm);
+            if (better) {
+                best = v;
+                best_dtm = dtm;
+                best_actions.clear();
+            }
+            if (better || (v == best && dtm == best_dtm)) best_actions.push_back(action);
+        }
+        return make_pair(best_actions, best);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,421 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <random>
+#include <cmath>
+
+#include "util.hpp"
+#include "search.hpp"
+#include "mcts.hpp"
+#include "tictactoe.hpp"
+#include "reversi.hpp"
+#include "animalshogi.hpp"
+#include "go.hpp"
+#include "geister.hpp"
+#include "fliptictactoe.hpp"
+#include "ismcts.hpp"
+
+using namespace std;
+
+// matches between two players
+// usage: arena <game> <player A> <player B> [-n games] [-t threads] [-o opening plies]
+//              [-s seed] [-sprt elo0 elo1]
+// players: random, alphabeta:<depth>, mcts:<simulations>, process:<command line of an engine>
+// games are played in pairs from the same random opening with colors swapped
+
+const int MAX_PLIES = 1000;
+const int PROCESS_TIMEOUT_MS = 60000;
+
+// events seen by players: an action (>= 0) or a chance seed (-1 - seed)
+
+template <class state_t>
+struct Player
+{
+    virtual ~Player() {}
+    virtual bool reset(long long /* setup_seed */) { return true; }
+    virtual bool event(const state_t& /* state */, long long /* e */) { return true; } // before e is applied
+    // act() of a process player also plays the action in the engine
+    virtual int act(const state_t& state, mt19937_64& mt) = 0; // -1 to resign
+};
+
+template <class state_t>
+struct RandomPlayer : Player<state_t>
+{
+    int act(const state_t& state, mt19937_64& mt)
+    {
+        vector<int> actions = state.legal_actions();
+        return actions[mt() % actions.size()];
+    }
+};
+
+template <class state_t>
+struct AlphaBetaPlayer : Player<state_t>
+{
+    int depth_;
+
+    AlphaBetaPlayer(int depth): depth_(depth) {}
+
+    int act(const state_t& state, mt19937_64& mt)
+    {
+        vector<int> actions = alpha_beta_search(state, depth_).first;
+        return actions[mt() % actions.size()];
+    }
+};
+
+template <class state_t>
+struct MCTSPlayer : Player<state_t>
+{
+    int simulations_;
+
+    MCTSPlayer(int simulations): simulations_(simulations) {}
+
+    int act(const state_t& state, mt19937_64& mt)
+    {
+        MCTS<state_t> mcts(1.0f, 300, 1 << 20, mt());
+        mcts.search(state, simulations_);
+        return mcts.best_action(state);
+    }
+};
+
+template <>
+int MCTSPlayer<Geister::State>::act(const Geister::State& state, mt19937_64& mt)
+{
+    // hidden colors are sampled instead of read from the state
+    Geister::ISMCTS search;
+    vector<int> visits = search.search(state, simulations_, 1, mt());
+    vector<int> actions = state.legal_actions();
+    int best = actions[0];
+    for (int action : actions) {
+        if (visits[action] > visits[best]) best = action;
+    }
+    return best;
+}
+
+template <class state_t>
+struct ProcessPlayer : Player<state_t>
+{
+    // an engine speaking the protocol of the engine target
+    Process process_;
+    vector<string> args_;
+    bool alive_;
+
+    ProcessPlayer(const string& command_line)
+    {
+        for (const string& a : split(command_line, ' ')) {
+            if (!a.empty()) args_.push_back(a);
+        }
+        vector<char*> argv;
+        for (string& a : args_) argv.push_back(const_cast<char*>(a.c_str()));
+        argv.push_back(nullptr);
+        alive_ = !args_.empty() && process_.start(argv[0], argv.data()) > 0;
+    }
+
+    bool send(const string& command, string *response = nullptr)
+    {
+        string r;
+        if (!alive_) return false;
+        int status = process_.request(command, response ? response : &r, PROCESS_TIMEOUT_MS);
+        if (status == Process::TIMEOUT || status == Process::CLOSED) alive_ = false;
+        return status == Process::SUCCESS;
+    }
+
+    bool reset(long long setup_seed)
+    {
+        return send("clear_board " + to_string(setup_seed));
+    }
+
+    bool event(const state_t& state, long long e)
+    {
+        if (e >= 0) return send("play " + state.action2str(e));
+        return send("chance " + to_string(-1 - e));
+    }
+
+    int act(const state_t& state, mt19937_64&)
+    {
+        string move;
+        if (!send("genmove", &move)) return -1;
+        for (int action : state.legal_actions()) {
+            if (state.action2str(action) == move) return action;
+        }
+        return -1;
+    }
+};
+
+template <class state_t>
+unique_ptr<Player<state_t>> make_player(const string& spec)
+{
+    size_t p = spec.find(':');
+    string kind = spec.substr(0, p), arg = p == string::npos ? "" : spec.substr(p + 1);
+    if (kind == "random")    return unique_ptr<Player<state_t>>(new RandomPlayer<state_t>());
+    if (kind == "alphabeta") return unique_ptr<Player<state_t>>(new AlphaBetaPlayer<state_t>(arg.empty() ? 2 : stoi(arg)));
+    if (kind == "mcts")      return unique_ptr<Player<state_t>>(new MCTSPlayer<state_t>(arg.empty() ? 1000 : stoi(arg)));
+    if (kind == "process")   return unique_ptr<Player<state_t>>(new ProcessPlayer<state_t>(arg));
+    return nullptr;
+}
+
+template <class state_t>
+bool has_chance()
+{
+    return false;
+}
+
+template <>
+bool has_chance<FlipTicTacToe::State>()
+{
+    return true; // cells are swapped after each action
+}
+
+// statistics of results from the view of player A
+
+struct Stats
+{
+    int wins_, draws_, losses_;
+
+    Stats(): wins_(0), draws_(0), losses_(0) {}
+
+    void add(int result)
+    {
+        if (result > 0) wins_++;
+        else if (result < 0) losses_++;
+        else draws_++;
+    }
+
+    int games() const { return wins_ + draws_ + losses_; }
+
+    double score() const { return (wins_ + 0.5 * draws_) / max(1, games()); }
+
+    static double variance(double w, double d, double l)
+    {
+        // of the score of a game with these outcome counts
+        double n = max(1.0, w + d + l), s = (w + 0.5 * d) / n;
+        return (w * (1 - s) * (1 - s) + d * (0.5 - s) * (0.5 - s) + l * s * s) / n;
+    }
+
+    double variance() const
+    {
+        return variance(wins_, draws_, losses_);
+    }
+
+    static double elo(double s)
+    {
+        s = min(max(s, 1e-6), 1 - 1e-6);
+        return -400 * log10(1 / s - 1);
+    }
+
+    static double expected_score(double elo)
+    {
+        return 1 / (1 + pow(10, -elo / 400));
+    }
+
+    array<double, 3> elo_interval() const
+    {
+        // estimate and 95% bounds
+        double s = score(), se = sqrt(variance() / max(1, games()));
+        return {elo(s), elo(s - 1.96 * se), elo(s + 1.96 * se)};
+    }
+
+    double llr(double elo0, double elo1) const
+    {
+        // log-likelihood ratio of the SPRT with a normal approximation; the variance counts
+        // one more win, draw and loss, so that it stays positive while all games end alike
+        double v = variance(wins_ + 1, draws_ + 1, losses_ + 1);
+        double s0 = expected_score(elo0), s1 = expected_score(elo1);
+        return games() * (s1 - s0) * (2 * score() - s0 - s1) / (2 * v);
+    }
+};
+
+struct Options
+{
+    string game, spec_a, spec_b;
+    int games = 100;
+    int threads = 1;
+    int opening_plies = 4;
+    long long seed = 0;
+    bool sprt = false;
+    double elo0 = 0, elo1 = 10, alpha = 0.05, beta = 0.05;
+};
+
+template <class state_t>
+int play_game(Player<state_t> *black, Player<state_t> *white,
+              long long setup_seed, const vector<long long>& opening, mt19937_64& mt)
+{
+    // result for black; a player failing to answer loses
+    Player<state_t> *players[2] = {black, white};
+    state_t state;
+    clear_state(state, setup_seed);
+    for (int c = 0; c < 2; c++) {
+        if (!players[c]->reset(setup_seed)) return c == BLACK ? -1 : 1;
+    }
+
+    auto apply = [&](long long e, int mover) {
+        // index of a player failing to follow, or -1; the mover already knows its action
+        for (int c = 0; c < 2; c++) {
+            if (c != mover && !players[c]->event(state, e)) return c;
+        }
+        if (e >= 0) state.play(e);
+        else state.chance(-1 - e);
+        return -1;
+    };
+    for (long long e : opening) {
+        int failed = apply(e, -1);
+        if (failed >= 0) return failed == BLACK ? -1 : 1;
+    }
+
+    for (int ply = 0; ply < MAX_PLIES && !state.terminal(); ply++) {
+        if (state.legal_actions().empty()) return 0;
+        int color = state.color_;
+        int action = players[color]->act(state, mt);
+        if (action < 0 || !state.legal(action)) return color == BLACK ? -1 : 1;
+        int failed = apply(action, color);
+        if (failed < 0 && has_chance<state_t>() && !state.terminal()) {
+            // the same order as the opening and self-play
+            failed = apply(-1 - (long long)(mt() & 0x7fffffff), -1);
+        }
+        if (failed >= 0) return failed == BLACK ? -1 : 1;
+    }
+    if (!state.terminal()) return 0;
+    float r = state.reward(false);
+    return r > 0 ? 1 : (r < 0 ? -1 : 0);
+}
+
+template <class state_t>
+vector<long long> random_opening(int plies, long long setup_seed, mt19937_64& mt)
+{
+    // actions, each followed by a chance event in games with chance
+    vector<long long> events;
+    state_t state;
+    clear_state(state, setup_seed);
+    for (int i = 0; i < plies && !state.terminal(); i++) {
+        vector<int> actions = state.legal_actions();
+        if (actions.empty()) break;
+        size_t size = events.size();
+        int action = actions[mt() % actions.size()];
+        state.play(action);
+        events.push_back(action);
+        if (has_chance<state_t>() && !state.terminal()) {
+            long long seed = mt() & 0x7fffffff;
+            state.chance(int(seed));
+            events.push_back(-1 - seed);
+        }
+        if (state.terminal()) {
+            // keep openings undecided
+            events.resize(size);
+            break;
+        }
+    }
+    return events;
+}
+
+template <class state_t>
+int run_arena(const Options& opt)
+{
+    const int pairs = (opt.games + 1) / 2;
+    atomic<int> next(0);
+    atomic<bool> stop(false);
+    mutex mtx;
+    Stats stats;
+    double lower = log(opt.beta / (1 - opt.alpha)), upper = log((1 - opt.beta) / opt.alpha);
+    auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (int t = 0; t < opt.threads; t++) {
+        workers.emplace_back([&]() {
+            auto a = make_player<state_t>(opt.spec_a);
+            auto b = make_player<state_t>(opt.spec_b);
+            while (!stop) {
+                int k = next++;
+                if (k >= pairs) break;
+                mt19937_64 mt(opt.seed * 1000003 + k);
+                long long setup_seed = mt() & 0x7fffffff;
+                vector<long long> opening = random_opening<state_t>(opt.opening_plies, setup_seed, mt);
+                int r0 = play_game(a.get(), b.get(), setup_seed, opening, mt);
+                int r1 = -play_game(b.get(), a.get(), setup_seed, opening, mt);
+
+                lock_guard<mutex> lock(mtx);
+                stats.add(r0);
+                stats.add(r1);
+                auto e = stats.elo_interval();
+                double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                cout << "pair " << k << " " << r0 << " " << r1
+                     << " | +" << stats.wins_ << " =" << stats.draws_ << " -" << stats.losses_
+                     << " elo " << e[0] << " [" << e[1] << ", " << e[2] << "]";
+                if (opt.sprt) {
+                    double llr = stats.llr(opt.elo0, opt.elo1);
+                    cout << " llr " << llr << " (" << lower << ", " << upper << ")";
+                    if (llr <= lower || llr >= upper) stop = true;
+                }
+                cout << " " << elapsed << " sec" << endl;
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+
+    auto e = stats.elo_interval();
+    cout << "result " << opt.spec_a << " vs " << opt.spec_b
+         << ": +" << stats.wins_ << " =" << stats.draws_ << " -" << stats.losses_
+         << " score " << stats.score() << " elo " << e[0] << " [" << e[1] << ", " << e[2] << "]";
+    if (opt.sprt) {
+        double llr = stats.llr(opt.elo0, opt.elo1);
+        cout << " sprt " << (llr >= upper ? "H1" : (llr <= lower ? "H0" : "inconclusive"));
+    }
+    cout << endl;
+    return 0;
+}
+
+template <class state_t>
+int check_and_run(const Options& opt)
+{
+    if (!make_player<state_t>(opt.spec_a) || !make_player<state_t>(opt.spec_b)) {
+        cerr << "unknown player" << endl;
+        return 1;
+    }
+    return run_arena<state_t>(opt);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        cerr << "usage: arena <game> <player A> <player B> [-n games] [-t threads] "
+             << "[-o opening plies] [-s seed] [-sprt elo0 elo1]" << endl;
+        return 1;
+    }
+    Options opt;
+    opt.game = argv[1];
+    opt.spec_a = argv[2];
+    opt.spec_b = argv[3];
+    opt.threads = max(1u, thread::hardware_concurrency());
+    for (int i = 4; i < argc; i++) {
+        string a = argv[i];
+        if (a == "-n" && i + 1 < argc) opt.games = atoi(argv[++i]);
+        else if (a == "-t" && i + 1 < argc) opt.threads = max(1, atoi(argv[++i]));
+        else if (a == "-o" && i + 1 < argc) opt.opening_plies = atoi(argv[++i]);
+        else if (a == "-s" && i + 1 < argc) opt.seed = atoll(argv[++i]);
+        else if (a == "-sprt" && i + 2 < argc) {
+            opt.sprt = true;
+            opt.elo0 = atof(argv[++i]);
+            opt.elo1 = atof(argv[++i]);
+        } else {
+            cerr << "unknown option " << a << endl;
+            return 1;
+        }
+    }
+
+    TicTacToe::init();
+    Reversi::init();
+    AnimalShogi::init();
+    Go::init();
+    Geister::init();
+    FlipTicTacToe::init();
+    // searches reach terminal positions often, where waiting for GNU Go would dominate
+    Go::use_gnugo = false;
+
+    if (opt.game == "TicTacToe")     return check_and_run<TicTacToe::State>(opt);
+    if (opt.game == "Reversi")       return check_and_run<Reversi::State>(opt);
+    if (opt.game == "AnimalShogi")   return check_and_run<AnimalShogi::State>(opt);
+    if (opt.game == "Go")            return check_and_run<Go::State>(opt);
+    if (opt.game == "Geister")       return check_and_run<Geister::State>(opt);
+    if (opt.game == "FlipTicTacToe") return check_and_run<FlipTicTacToe::State>(opt);
+    cerr << "unknown game " << opt.game << endl;
+    return 1;
+}
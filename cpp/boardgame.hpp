@@ -3,6 +3,10 @@
 // common code for two-player board game
 
 #include <array>
+#include <cassert>
+#include <vector>
+
+#include "util.hpp"
 
 const int BLACK = 0;
 const int WHITE = 1;
@@ -76,4 +80,153 @@ const int D2[20][2] = {
 inline int point_symmetry(int d)
 {
     return (d / 4) * 4 + 3 - (d % 4);
-}
\ No newline at end of file
+}
+
+inline int transform_direction(int sym, int d)
+{
+    // direction after a symmetry of symmetry.hpp
+    int dx = D2[d][0], dy = D2[d][1];
+    if (sym & 1) dx = -dx;
+    if (sym & 2) dy = -dy;
+    if (sym & 4) std::swap(dx, dy);
+    for (int e = 0; e < 20; e++) {
+        if (D2[e][0] == dx && D2[e][1] == dy) return e;
+    }
+    return d;
+}
+
+// initial positions; games with a random arrangement (Geister) take the seed in clear()
+
+template <class state_t>
+auto clear_with_seed(state_t& s, long long seed, int) -> decltype(s.clear(seed))
+{
+    s.clear(seed);
+}
+
+template <class state_t>
+auto clear_with_seed(state_t& s, long long, long) -> decltype(s.clear())
+{
+    s.clear();
+}
+
+template <class state_t>
+void clear_state(state_t& s, long long seed)
+{
+    clear_with_seed(s, seed, 0);
+}
+
+// position history for repetition detection
+// keys are stacked by ply and counted in an open-addressed table,
+// so that both updates and lookups are O(1) without node allocation;
+// the table is allocated by the first push, so that fresh states copy without allocating
+
+struct KeyHistory
+{
+    struct Slot
+    {
+        long long key_;
+        int count_;
+    };
+
+    std::vector<long long> keys_; // ply-indexed
+    std::vector<Slot> table_; // empty until the first push
+    int bits_;
+
+    KeyHistory()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        keys_.clear();
+        table_.clear();
+        bits_ = 0;
+    }
+
+    std::size_t size() const
+    {
+        return keys_.size();
+    }
+
+    int home(long long key) const
+    {
+        return (unsigned long long)key * 0x9E3779B97F4A7C15ULL >> (64 - bits_);
+    }
+
+    int slot(long long key) const
+    {
+        int mask = (1 << bits_) - 1;
+        int i = home(key);
+        while (table_[i].count_ > 0 && table_[i].key_ != key) i = (i + 1) & mask;
+        return i;
+    }
+
+    int count(long long key) const
+    {
+        return table_.empty() ? 0 : table_[slot(key)].count_;
+    }
+
+    void push(long long key)
+    {
+        if ((keys_.size() + 1) * 2 > table_.size()) rehash(std::max(bits_ + 1, 6));
+        keys_.push_back(key);
+        Slot& s = table_[slot(key)];
+        s.key_ = key;
+        s.count_ += 1;
+    }
+
+    void pop()
+    {
+        long long key = keys_.back();
+        keys_.pop_back();
+        int i = slot(key);
+        assert(table_[i].count_ > 0);
+        if (--table_[i].count_ > 0) return;
+
+        // backward shift deletion
+        int mask = (1 << bits_) - 1;
+        for (int j = (i + 1) & mask; table_[j].count_ > 0; j = (j + 1) & mask) {
+            int h = home(table_[j].key_);
+            bool movable = i <= j ? (h <= i || h > j) : (h <= i && h > j);
+            if (movable) {
+                table_[i] = table_[j];
+                table_[j].count_ = 0;
+                i = j;
+            }
+        }
+    }
+
+    void serialize(BinaryWriter *w) const
+    {
+        // only the keys; the counter table is rebuilt
+        w->write_as<long long>(keys_);
+    }
+
+    bool deserialize(BinaryReader *r)
+    {
+        std::vector<long long> keys;
+        if (!r->read_as<long long>(&keys)) return false;
+        keys_.swap(keys);
+        if (keys_.empty()) {
+            table_.clear();
+            bits_ = 0;
+            return true;
+        }
+        int bits = 6;
+        while ((keys_.size() + 1) * 2 > (1ULL << bits)) bits++;
+        rehash(bits);
+        return true;
+    }
+
+    void rehash(int bits)
+    {
+        bits_ = bits;
+        table_.assign(1 << bits_, Slot{0, 0});
+        for (long long key : keys_) {
+            Slot& s = table_[slot(key)];
+            s.key_ = key;
+            s.count_ += 1;
+        }
+    }
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+// depth-first proof-number search
+// proves or disproves that the side to move at the root can force a win
+// (phi, delta) are stored from the side to move at each node:
+// phi = 0 means a proven win, delta = 0 means a proven loss or draw
+// draws come from repetitions, which depend on the path to a node, so a node the defender
+// holds through one keeps UNKNOWN in place of INF: it still steers the search on other paths
+// but is never reported as a disproof
+
+#include "util.hpp"
+
+using namespace std;
+
+template <class state_t>
+struct DFPN
+{
+    static constexpr int INF = 1 << 28;
+    static constexpr int UNKNOWN = INF - 1; // also the largest threshold
+
+    struct Entry
+    {
+        long long key_;
+        int phi_, delta_;
+    };
+
+    vector<Entry> table_;
+    int attacker_;
+    long long nodes_, max_nodes_;
+    long long draws_; // repetition-dependent values seen so far
+
+    DFPN(int table_bits = 18):
+    table_(1 << table_bits, Entry{0, 0, 0}),
+    attacker_(0),
+    nodes_(0),
+    max_nodes_(0),
+    draws_(0) {}
+
+    static long long node_key(const state_t& state)
+    {
+        // symmetric positions share their proof numbers
+        return state.canonical_hash().first;
+    }
+
+    Entry& slot(long long key)
+    {
+        return table_[(unsigned long long)key * 0x9E3779B97F4A7C15ULL >> (64 - bsf(table_.size()))];
+    }
+
+    void store(long long key, int phi, int delta)
+    {
+        // keep proofs and disproofs unless the same node is updated
+        Entry& e = slot(key);
+        bool final_entry = (e.phi_ == 0) != (e.delta_ == 0);
+        if (e.key_ != key && final_entry && phi != 0 && delta != 0) return;
+        e = Entry{key, phi, delta};
+    }
+
+    pair<int, int> value(const state_t& state)
+    {
+        if (state.terminal()) {
+            // draws are counted as wins of the defender
+            float r = state.reward();
+            int inf = r == 0 ? UNKNOWN : INF;
+            if (r == 0) draws_++;
+            bool win = state.color_ == attacker_ ? r > 0 : r >= 0;
+            return win ? make_pair(0, inf) : make_pair(inf, 0);
+        }
+        long long key = node_key(state);
+        Entry& e = slot(key);
+        if (e.key_ == key && (e.phi_ != 0 || e.delta_ != 0)) {
+            if (e.phi_ == UNKNOWN || e.delta_ == UNKNOWN) draws_++;
+            return make_pair(e.phi_, e.delta_);
+        }
+        return make_pair(1, 1);
+    }
+
+    void mid(state_t& state, int thphi, int thdelta)
+    {
+        nodes_++;
+        long long draws = draws_;
+        vector<int> actions = state.legal_actions();
+        if (actions.empty()) {
+            store(node_key(state), INF, 0);
+            return;
+        }
+
+        while (true) {
+            int phi = INF, delta = 0, delta2 = INF;
+            int best = -1, best_phi = 0;
+            for (int i = 0; i < int(actions.size()); i++) {
+                state.play(actions[i]);
+                auto v = value(state);
+                state.undo();
+                delta = min(INF, delta + v.first);
+                if (v.second < phi) {
+                    delta2 = phi;
+                    phi = v.second;
+                    best = i;
+                    best_phi = v.first;
+                } else if (v.second < delta2) {
+                    delta2 = v.second;
+                }
+            }
+            if (draws_ > draws) {
+                if (state.color_ == attacker_ && delta == 0) phi = UNKNOWN;
+                if (state.color_ != attacker_ && phi == 0) delta = UNKNOWN;
+            }
+            store(node_key(state), phi, delta);
+            if (phi >= thphi || delta >= thdelta || nodes_ >= max_nodes_) return;
+
+            long long child_thphi = (long long)thdelta - delta + best_phi;
+            int child_thdelta = min((long long)thphi, (long long)delta2 + 1);
+            state.play(actions[best]);
+            mid(state, int(min(child_thphi, (long long)UNKNOWN)), child_thdelta);
+            state.undo();
+        }
+    }
+
+    int search(state_t& state, long long max_nodes)
+    {
+        // 1 for a proven win, -1 for a disproof, 0 when the budget runs out
+        // or the defender only holds through a repetition
+        attacker_ = state.color_;
+        nodes_ = 0;
+        max_nodes_ = max_nodes;
+        draws_ = 0;
+        if (!state.terminal()) mid(state, UNKNOWN, UNKNOWN);
+        auto v = value(state);
+        if (v.first == 0) return 1;
+        if (v.second == 0 && v.first == INF) return -1;
+        return 0;
+    }
+
+    vector<int> proof_line(state_t& state, int max_length = 256)
+    {
+        // follow proven moves of the attacker and any reply of the defender
+        vector<int> line;
+        while (int(line.size()) < max_length && !state.terminal()) {
+            int next = -1;
+            for (int action : state.legal_actions()) {
+                state.play(action);
+                auto v = value(state);
+                state.undo();
+                bool proven = state.color_ == attacker_ ? v.second == 0 : v.first == 0;
+                if (!proven) {
+                    if (state.color_ == attacker_) continue;
+                    next = -1;
+                    break;
+                }
+                if (next < 0) next = action;
+            }
+            if (next < 0) break;
+            state.play(next);
+            line.push_back(next);
+        }
+        for (int i = 0; i < int(line.size()); i++) state.undo();
+        return line;
+    }
+};
+
+template <class state_t>
+constexpr int DFPN<state_t>::INF;
+template <class state_t>
+constexpr int DFPN<state_t>::UNKNOWN;
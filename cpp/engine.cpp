@@ -0,0 +1,403 @@
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <cctype>
+
+#include "util.hpp"
+#include "mcts.hpp"
+#include "tictactoe.hpp"
+#include "reversi.hpp"
+#include "animalshogi.hpp"
+#include "go.hpp"
+#include "geister.hpp"
+#include "fliptictactoe.hpp"
+#include "ismcts.hpp"
+
+using namespace std;
+
+// engine speaking a GTP-like protocol on stdin/stdout
+// usage: engine [game]
+//
+// commands (an optional numeric id may precede each one):
+//   game <name>, clear_board [seed], play [color] <move>, undo, chance [seed],
+//   genmove [color], time_settings <main> <byoyomi> <stones>, time_left <color> <time> <stones>,
+//   set_simulations <n>, ponder <on|off>, showboard, legal_moves, final_score,
+//   name, version, protocol_version, list_commands, known_command <command>, quit
+// moves are written as action2str() of the game
+
+const vector<string> COMMANDS = {
+    "game", "clear_board", "play", "undo", "chance", "genmove",
+    "time_settings", "time_left", "set_simulations", "ponder",
+    "showboard", "legal_moves", "final_score",
+    "name", "version", "protocol_version", "list_commands", "known_command", "quit"
+};
+
+struct EngineBase
+{
+    virtual ~EngineBase() {}
+    virtual bool command(const string& name, const vector<string>& args, string *response) = 0;
+    virtual void start_pondering() = 0;
+    virtual void stop_pondering() = 0;
+};
+
+template <class state_t>
+struct Engine : EngineBase
+{
+    // events replayed by undo: an action (>= 0) or a chance seed (-1 - seed)
+    state_t state_;
+    vector<long long> events_;
+    long long setup_seed_;
+
+    MCTS<state_t> mcts_;
+    int simulations_;
+    double main_time_, byoyomi_;
+    int byoyomi_stones_; // moves per byoyomi period, 0 for a period per move
+    array<double, 2> time_left_; // of each color
+    array<int, 2> stones_left_; // moves left in the current byoyomi period, 0 in main time
+
+    bool ponder_;
+    atomic<bool> stop_;
+    thread ponder_thread_;
+
+    Engine():
+    setup_seed_(0),
+    simulations_(10000),
+    main_time_(0), byoyomi_(0), byoyomi_stones_(0),
+    time_left_(), stones_left_(),
+    ponder_(false),
+    stop_(false) {}
+
+    ~Engine()
+    {
+        stop_pondering();
+    }
+
+    void start_pondering()
+    {
+        if (!ponder_ || state_.terminal() || ponder_thread_.joinable()) return;
+        stop_ = false;
+        ponder_thread_ = thread([this]() {
+            mcts_.search(state_, 1 << 30, -1, &stop_);
+        });
+    }
+
+    void stop_pondering()
+    {
+        if (!ponder_thread_.joinable()) return;
+        stop_ = true;
+        ponder_thread_.join();
+    }
+
+    void clear(long long seed);
+
+    void play(int action)
+    {
+        state_.play(action);
+        mcts_.advance(action);
+        events_.push_back(action);
+    }
+
+    int parse_move(const string& str) const
+    {
+        for (int action : state_.legal_actions()) {
+            if (state_.action2str(action) == str) return action;
+        }
+        return -1;
+    }
+
+    static int parse_color(const string& str)
+    {
+        string s = str;
+        for (char& c : s) c = tolower(c);
+        if (s == "b" || s == "black") return BLACK;
+        if (s == "w" || s == "white") return WHITE;
+        return -1;
+    }
+
+    double budget(int color) const
+    {
+        // seconds for the next move of color; no limit without time settings
+        if (main_time_ <= 0 && byoyomi_ <= 0) return -1;
+        double t;
+        if (stones_left_[color] > 0) {
+            t = max(0.0, time_left_[color]) / stones_left_[color] * 0.9;
+        } else {
+            double period = byoyomi_stones_ > 0 ? byoyomi_ / byoyomi_stones_ : byoyomi_;
+            t = max(0.0, time_left_[color]) / 20 + period * 0.9;
+        }
+        return max(t, 0.01);
+    }
+
+    void spend(int color, double seconds)
+    {
+        // the clock of color after a move; byoyomi periods follow the main time
+        // and restart once their moves are made
+        time_left_[color] -= seconds;
+        bool next_period = stones_left_[color] > 0 ? --stones_left_[color] == 0 : time_left_[color] <= 0;
+        if (next_period && byoyomi_stones_ > 0) {
+            time_left_[color] = byoyomi_;
+            stones_left_[color] = byoyomi_stones_;
+        }
+    }
+
+    int think(double seconds)
+    {
+        mcts_.search(state_, simulations_, seconds);
+        return mcts_.best_action(state_);
+    }
+
+    bool command(const string& name, const vector<string>& args, string *response)
+    {
+        if (name == "clear_board") {
+            clear(args.empty() ? 0 : stoll(args[0]));
+            return true;
+        }
+        if (name == "play") {
+            if (args.empty()) {
+                *response = "missing move";
+                return false;
+            }
+            if (state_.terminal()) {
+                *response = "game is over";
+                return false;
+            }
+            int action = parse_move(args.back());
+            if (action < 0) {
+                *response = "illegal move";
+                return false;
+            }
+            play(action);
+            return true;
+        }
+        if (name == "undo") {
+            while (!events_.empty() && events_.back() < 0) events_.pop_back();
+            if (events_.empty()) {
+                *response = "cannot undo";
+                return false;
+            }
+            events_.pop_back();
+            vector<long long> events;
+            events.swap(events_);
+            clear(setup_seed_);
+            for (long long e : events) {
+                if (e >= 0) state_.play(e);
+                else state_.chance(-1 - e);
+            }
+            events_.swap(events);
+            return true;
+        }
+        if (name == "chance") {
+            long long seed = args.empty() ? random_device()() : stoll(args[0]);
+            seed &= 0x7fffffff;
+            state_.chance(seed);
+            events_.push_back(-1 - seed);
+            return true;
+        }
+        if (name == "genmove") {
+            if (state_.terminal()) {
+                *response = "game is over";
+                return false;
+            }
+            int color = state_.color_;
+            if (!args.empty() && parse_color(args[0]) != color) {
+                *response = "not the side to move";
+                return false;
+            }
+            auto start = chrono::steady_clock::now();
+            int action = think(budget(color));
+            if (main_time_ > 0 || byoyomi_ > 0) {
+                spend(color, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            }
+            *response = state_.action2str(action);
+            play(action);
+            return true;
+        }
+        if (name == "time_settings") {
+            if (args.size() < 2) {
+                *response = "missing time settings";
+                return false;
+            }
+            main_time_ = stod(args[0]);
+            byoyomi_ = stod(args[1]);
+            byoyomi_stones_ = args.size() > 2 ? max(0, stoi(args[2])) : 0;
+            bool byoyomi_only = main_time_ <= 0 && byoyomi_stones_ > 0;
+            time_left_.fill(byoyomi_only ? byoyomi_ : main_time_);
+            stones_left_.fill(byoyomi_only ? byoyomi_stones_ : 0);
+            return true;
+        }
+        if (name == "time_left") {
+            if (args.size() < 2) {
+                *response = "missing time";
+                return false;
+            }
+            int color = parse_color(args[0]);
+            if (color < 0) {
+                *response = "invalid color";
+                return false;
+            }
+            time_left_[color] = stod(args[1]);
+            stones_left_[color] = args.size() > 2 ? max(0, stoi(args[2])) : 0;
+            return true;
+        }
+        if (name == "set_simulations") {
+            if (args.empty()) {
+                *response = "missing number";
+                return false;
+            }
+            simulations_ = max(1, stoi(args[0]));
+            return true;
+        }
+        if (name == "ponder") {
+            ponder_ = !args.empty() && args[0] == "on";
+            return true;
+        }
+        if (name == "showboard") {
+            *response = "\n" + state_.to_string();
+            while (!response->empty() && response->back() == '\n') response->pop_back();
+            return true;
+        }
+        if (name == "legal_moves") {
+            vector<string> moves;
+            for (int action : state_.legal_actions()) moves.push_back(state_.action2str(action));
+            *response = join(moves, " ");
+            return true;
+        }
+        if (name == "final_score") {
+            if (!state_.terminal()) {
+                *response = "game is not over";
+                return false;
+            }
+            float r = state_.reward(false);
+            *response = r > 0 ? "B+" : (r < 0 ? "W+" : "0");
+            return true;
+        }
+        *response = "unknown command";
+        return false;
+    }
+};
+
+template <class state_t>
+void Engine<state_t>::clear(long long seed)
+{
+    state_.clear();
+    mcts_.clear();
+    events_.clear();
+    setup_seed_ = seed;
+}
+
+template <>
+void Engine<Geister::State>::clear(long long seed)
+{
+    // the seed selects the initial arrangement
+    state_.clear(seed);
+    mcts_.clear();
+    events_.clear();
+    setup_seed_ = seed;
+}
+
+template <>
+void Engine<Geister::State>::start_pondering()
+{
+    // the information set tree is rebuilt at each search
+}
+
+template <>
+int Engine<Geister::State>::think(double seconds)
+{
+    // hidden colors of the opponent are sampled instead of read from the state
+    Geister::ISMCTS search;
+    vector<int> visits = search.search(state_, simulations_, 1, events_.size(), seconds);
+    vector<int> actions = state_.legal_actions();
+    int best = actions[0];
+    for (int action : actions) {
+        if (visits[action] > visits[best]) best = action;
+    }
+    return best;
+}
+
+EngineBase *make_engine(const string& game)
+{
+    if (game == "TicTacToe")     return new Engine<TicTacToe::State>();
+    if (game == "Reversi")       return new Engine<Reversi::State>();
+    if (game == "AnimalShogi")   return new Engine<AnimalShogi::State>();
+    if (game == "Go")            return new Engine<Go::State>();
+    if (game == "Geister")       return new Engine<Geister::State>();
+    if (game == "FlipTicTacToe") return new Engine<FlipTicTacToe::State>();
+    return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+    TicTacToe::init();
+    Reversi::init();
+    AnimalShogi::init();
+    Go::init();
+    Geister::init();
+    FlipTicTacToe::init();
+    // playouts end at terminal positions, where waiting for GNU Go would dominate
+    Go::use_gnugo = false;
+
+    string game = argc > 1 ? argv[1] : "TicTacToe";
+    unique_ptr<EngineBase> engine(make_engine(game));
+    if (!engine) {
+        cerr << "unknown game " << game << endl;
+        return 1;
+    }
+
+    string line;
+    while (std::getline(cin, line)) {
+        line = strip(line, '\r');
+        vector<string> tokens;
+        for (const string& t : split(line, ' ')) {
+            if (!t.empty()) tokens.push_back(t);
+        }
+        if (tokens.empty() || tokens[0][0] == '#') continue;
+
+        string id;
+        if (isdigit(tokens[0][0])) {
+            id = tokens[0];
+            tokens.erase(tokens.begin());
+            if (tokens.empty()) continue;
+        }
+        string name = tokens[0];
+        vector<string> args(tokens.begin() + 1, tokens.end());
+
+        engine->stop_pondering();
+        bool ok = true, quit = false;
+        string response;
+        try {
+            if (name == "quit") {
+                quit = true;
+            } else if (name == "name") {
+                response = "GameImplementation";
+            } else if (name == "version") {
+                response = "1.0";
+            } else if (name == "protocol_version") {
+                response = "2";
+            } else if (name == "list_commands") {
+                response = join(COMMANDS, "\n");
+            } else if (name == "known_command") {
+                ok = !args.empty();
+                response = ok && find(COMMANDS.begin(), COMMANDS.end(), args[0]) != COMMANDS.end() ? "true" : "false";
+            } else if (name == "game") {
+                EngineBase *e = args.empty() ? nullptr : make_engine(args[0]);
+                ok = e != nullptr;
+                if (ok) engine.reset(e);
+                else response = "unknown game";
+            } else {
+                ok = engine->command(name, args, &response);
+            }
+        } catch (const exception& e) {
+            ok = false;
+            response = "invalid argument";
+        }
+
+        cout << (ok ? "=" : "?") << id;
+        if (!response.empty()) cout << " " << response;
+        cout << "\n" << endl;
+        if (quit) break;
+        engine->start_pondering();
+    }
+    return 0;
+}
@@ -13,18 +13,40 @@ namespace FlipTicTacToe
     struct State : public TicTacToe::State
     {
         using base_t = TicTacToe::State;
-        array<int, 2> score_;
-        vector<pair<int, int>> flip_record_;
+        array<int8_t, 2> score_;
+        FixedVector<array<int8_t, 2>, TicTacToe::B> flip_record_;
+
+        using Position = State;
 
         State():
         base_t(),
         score_(),
         flip_record_() {}
 
-        State(const State& s):
-        base_t(s),
-        score_(s.score_),
-        flip_record_(s.flip_record_) {}
+        Position position() const
+        {
+            return *this;
+        }
+
+        bool set_position(const Position& p)
+        {
+            if (!p.valid()) return false;
+            *this = p;
+            reset_symmetric_keys();
+            return true;
+        }
+
+        bool valid() const
+        {
+            if (!base_t::valid() || score_[0] < 0 || score_[1] < 0) return false;
+            if (flip_record_.size() > flip_record_.capacity()) return false;
+            for (const auto& cells : flip_record_) {
+                for (int pos : cells) {
+                    if (pos < 0 || pos >= TicTacToe::B) return false;
+                }
+            }
+            return true;
+        }
 
         void clear()
         {
@@ -33,6 +55,33 @@ namespace FlipTicTacToe
             flip_record_.clear();
         }
 
+        void serialize(BinaryWriter *w) const
+        {
+            base_t::serialize(w);
+            w->write(score_);
+            w->write_as<array<int8_t, 2>>(flip_record_);
+        }
+
+        bool deserialize(BinaryReader *r)
+        {
+            return base_t::deserialize(r)
+                && r->read(&score_)
+                && r->read_as<array<int8_t, 2>>(&flip_record_)
+                && valid();
+        }
+
+        void swap_cells(int pos0, int pos1)
+        {
+            int mask = (1 << pos0) | (1 << pos1);
+            for (int c = 0; c < 2; c++) {
+                if (((stones_[c] >> pos0) ^ (stones_[c] >> pos1)) & 1) {
+                    stones_[c] ^= mask;
+                    toggle_stone_key(pos0, c);
+                    toggle_stone_key(pos1, c);
+                }
+            }
+        }
+
         void chance(int seed=-1)
         {
             if (record_.empty()) return;
@@ -41,39 +90,35 @@ namespace FlipTicTacToe
                 seed = rd();
             }
             mt19937 mt(seed);
-            const int l = base_t::L_;
-            const int b = l * l;
+            const int b = TicTacToe::B;
             int pos0 = mt() % b;
             int pos1 = mt() % (b - 1);
             if (pos1 >= pos0) pos1++;
+            flip(pos0, pos1);
+        }
 
-            swap(base_t::board_[pos0], base_t::board_[pos1]);
-            flip_record_.push_back(make_pair(pos0, pos1));
+        void flip(int pos0, int pos1)
+        {
+            // the outcome of chance()
+            const int b = TicTacToe::B;
+            swap_cells(pos0, pos1);
+            flip_record_.push_back({{int8_t(pos0), int8_t(pos1)}});
 
             // winning check
             for (int c = 0; c < 2; c++) {
-                score_[c] = 0;
-                for (int x = 0; x < base_t::L_; x++) {
-                    int sum[2] = {0, 0};
-                    for (int y = 0; y < base_t::L_; y++) sum[0] += base_t::board_[xy2action(x, y)] == c ? 1 : 0;
-                    for (int y = 0; y < base_t::L_; y++) sum[1] += base_t::board_[xy2action(y, x)] == c ? 1 : 0;
-                    for (int i = 0; i < 2; i++) if (sum[i] == base_t::L_) score_[c]++;
-                }
-                int sum[2] = {0, 0};
-                for (int x = 0; x < base_t::L_; x++) sum[0] += base_t::board_[xy2action(x, x)] == c ? 1 : 0;
-                for (int x = 0; x < base_t::L_; x++) sum[1] += base_t::board_[xy2action(x, base_t::L_ - 1 - x)] == c ? 1 : 0;
-                for (int i = 0; i < 2; i++) if (sum[i] == base_t::L_) score_[c]++;
+                score_[c] = TicTacToe::count_lines(stones_[c]);
             }
             if      (score_[0] > score_[1]) base_t::win_color_ = BLACK;
             else if (score_[0] <= score_[1]) {
-                if (score_[1] > 0 || int(flip_record_.size()) == L_ * L_) base_t::win_color_ = WHITE;
+                if (score_[1] > 0 || int(flip_record_.size()) == b) base_t::win_color_ = WHITE;
             }
         }
 
         void play(int action)
         {
             assert(legal(action));
-            board_[action] = color_;
+            stones_[color_] |= 1 << action;
+            toggle_stone_key(action, color_);
 
             color_ = opponent(color_);
             record_.push_back(action);
@@ -85,7 +130,10 @@ namespace FlipTicTacToe
             assert(!flip_record_.empty());
             auto flipped = flip_record_.back();
             flip_record_.pop_back();
-            swap(base_t::board_[flipped.first], base_t::board_[flipped.second]);
+            swap_cells(flipped[0], flipped[1]);
+            for (int c = 0; c < 2; c++) {
+                score_[c] = TicTacToe::count_lines(stones_[c]);
+            }
             win_color_ = EMPTY;
         }
 
@@ -95,24 +143,41 @@ namespace FlipTicTacToe
             int action = record_.back();
             record_.pop_back();
             color_ = opponent(color_);
-            board_[action] = EMPTY;
+            for (int c = 0; c < 2; c++) {
+                if (stones_[c] >> action & 1) toggle_stone_key(action, c);
+                stones_[c] &= ~(1 << action);
+            }
         }
 
         bool terminal() const
         {
-            return score_[0] + score_[1] > 0 || int(flip_record_.size()) == L_ * L_;
+            return score_[0] + score_[1] > 0 || int(flip_record_.size()) == TicTacToe::B;
+        }
+
+        int feature_channels() const
+        {
+            return 3;
         }
 
         vector<float> feature() const
         {
-            const int b = base_t::L_ * base_t::L_;
-            vector<float> f(3 * b, 0.0f);
+            vector<float> f(feature_channels() * TicTacToe::B);
+            feature_into(f.data());
+            return f;
+        }
+
+        void feature_into(float *f) const
+        {
+            // feature_channels() planes written into f
+            const int b = TicTacToe::B;
+            fill(f, f + 3 * b, 0.0f);
             for (int pos = 0; pos < b; pos++) {
-                if (board_[pos] == color_)           f[pos] = 1;
-                if (board_[pos] == opponent(color_)) f[pos + b] = 1;
-                if (color_ == BLACK)                 f[pos + b * 2] = 1;
+                if (stones_[color_]           >> pos & 1) f[pos] = 1;
+                if (stones_[opponent(color_)] >> pos & 1) f[pos + b] = 1;
+                if (color_ == BLACK)                      f[pos + b * 2] = 1;
             }
-            return f;
         }
     };
+
+    static_assert(is_trivially_copyable<State>::value, "FlipTicTacToe::State must be plain memory");
 }
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <random>
+#include <type_traits>
 
 #include "util.hpp"
 #include "boardgame.hpp"
+#include "symmetry.hpp"
 
 using namespace std;
 
@@ -26,6 +28,7 @@ namespace Geister
     };
 
     vector<array<long long, 16>> POSITION_KEY;
+    array<int, 16> MIRROR_INDEX; // index of the piece starting at the mirrored square
 
     inline void init() {
         mt19937_64 mt(0);
@@ -36,10 +39,26 @@ namespace Geister
             }
             POSITION_KEY.push_back(keys);
         }
+        for (int c = 0; c < 2; c++) {
+            for (int i = 0; i < 8; i++) {
+                string s = OPOS[c][i];
+                s[0] = X[X.size() - 1 - X.find(s[0])];
+                int j = find(OPOS[c].begin(), OPOS[c].end(), s) - OPOS[c].begin();
+                MIRROR_INDEX[c * 8 + i] = c * 8 + j;
+            }
+        }
     }
 
     struct State
     {
+        struct Change
+        {
+            // for undo
+            int8_t piece_;       // captured or goaled piece (-1 for none)
+            int8_t piece_index_;
+            int8_t win_color_;   // before the action
+        };
+
         const int L_ = 6;
         const int B_ = L_ * L_;
         vector<int> board_;
@@ -49,9 +68,23 @@ namespace Geister
         array<int, 16> piece_position_;
         vector<int> board_index_;
         long long key_;
-        map<long long, int> prev_keys_;
+        long long mirror_key_; // key_ of the mirrored position
+        KeyHistory keys_;
+        vector<Change> changes_;
         vector<int> record_;
 
+        // plain memory snapshot of a position with the latest keys for repetition;
+        // the record and what undo() needs are left out
+        struct Position
+        {
+            array<int8_t, 6 * 6> board_, board_index_;
+            array<int8_t, 16> piece_position_;
+            array<int8_t, 4> piece_cnt_;
+            int8_t color_, win_color_;
+            long long key_, mirror_key_;
+            FixedVector<long long, 32> keys_;
+        };
+
         State()
         {
             board_.resize(B_);
@@ -67,7 +100,9 @@ namespace Geister
         piece_position_(s.piece_position_),
         board_index_(s.board_index_),
         key_(s.key_),
-        prev_keys_(s.prev_keys_),
+        mirror_key_(s.mirror_key_),
+        keys_(s.keys_),
+        changes_(s.changes_),
         record_(s.record_) {}
 
         array<int, 2> size() const
@@ -75,8 +110,59 @@ namespace Geister
             return {L_, L_};
         }
 
+        Position position() const
+        {
+            Position p;
+            copy(board_.begin(), board_.end(), p.board_.begin());
+            copy(board_index_.begin(), board_index_.end(), p.board_index_.begin());
+            copy(piece_position_.begin(), piece_position_.end(), p.piece_position_.begin());
+            copy(piece_cnt_.begin(), piece_cnt_.end(), p.piece_cnt_.begin());
+            p.color_ = color_;
+            p.win_color_ = win_color_;
+            p.key_ = key_;
+            p.mirror_key_ = mirror_key_;
+            p.keys_.clear();
+            size_t n = keys_.size(), first = n - min(n, p.keys_.capacity());
+            for (size_t i = first; i < n; i++) p.keys_.push_back(keys_.keys_[i]);
+            return p;
+        }
+
+        bool set_position(const Position& p)
+        {
+            // the record starts here; piece counts and keys are rebuilt from the board
+            if (p.keys_.size() > p.keys_.capacity()) return false;
+            copy(p.board_.begin(), p.board_.end(), board_.begin());
+            copy(p.board_index_.begin(), p.board_index_.end(), board_index_.begin());
+            copy(p.piece_position_.begin(), p.piece_position_.end(), piece_position_.begin());
+            color_ = p.color_;
+            win_color_ = p.win_color_;
+            if (!valid_position()) return false;
+            reset_keys();
+            keys_.clear();
+            for (long long key : p.keys_) keys_.push(key);
+            changes_.clear();
+            record_.clear();
+            return true;
+        }
+
         void clear(long long seed = 0)
         {
+            // randomly setting original position
+            mt19937_64 mt(seed);
+            array<int, 2> setup;
+            for (int c = 0; c < 2; c++) {
+                array<int, 8> seq;
+                for (int i = 0; i < 8; i++) seq[i] = i;
+                shuffle(seq.begin(), seq.end(), mt);
+                setup[c] = 0;
+                for (int i = 0; i < 4; i++) setup[c] |= 1 << seq[i];
+            }
+            set_setup(setup);
+        }
+
+        void set_setup(const array<int, 2>& setup)
+        {
+            // bit i of setup[c]: whether piece i of color c (at OPOS[c][i]) is blue
             fill(board_.begin(), board_.end(), -1);
             color_ = BLACK;
             win_color_ = -1;
@@ -84,27 +170,104 @@ namespace Geister
             piece_position_.fill(-1);
             fill(board_index_.begin(), board_index_.end(), -1);
             key_ = 0;
-            prev_keys_.clear();
+            mirror_key_ = 0;
+            keys_.clear();
+            changes_.clear();
             record_.clear();
 
-            // randomly setting original position
-            mt19937_64 mt(seed);
             for (int c = 0; c < 2; c++) {
-                array<int, 8> seq;
-                for (int i = 0; i < 8; i++) seq[i] = i;
-                shuffle(seq.begin(), seq.end(), mt);
-                for (int t = 0; t < 2; t++) {
-                    for (int i = t * 4; i < (t + 1) * 4; i++) {
-                        int index = seq[i];
-                        int piece = colortype2piece(c, t);
-                        int pos = str2position(OPOS[c][index]);
-                        put_piece(piece, pos, c * 8 + index);
-                    }
+                for (int index = 0; index < 8; index++) {
+                    int piece = colortype2piece(c, (setup[c] >> index & 1) ? BLUE : RED);
+                    int pos = str2position(OPOS[c][index]);
+                    put_piece(piece, pos, c * 8 + index);
                 }
             }
 
-            long long key = key_ ^ color_;
-            prev_keys_[key] += 1;
+            keys_.push(key_ ^ color_);
+        }
+
+        array<int, 2> setup() const
+        {
+            // the argument of set_setup() for the initial position of this game
+            array<int, 2> setup = {0, 0};
+            for (int index = 0; index < 16; index++) {
+                int pos = piece_position_[index], piece = pos >= 0 ? board_[pos] : -1;
+                for (const Change& change : changes_) {
+                    if (change.piece_index_ == index && change.piece_ >= 0) piece = change.piece_;
+                }
+                if (piece2type(piece) == BLUE) setup[index / 8] |= 1 << (index % 8);
+            }
+            return setup;
+        }
+
+        void serialize(BinaryWriter *w) const
+        {
+            w->write_as<int8_t>(board_);
+            w->write(int8_t(color_));
+            w->write(int8_t(win_color_));
+            w->write_as<int8_t>(piece_cnt_);
+            w->write_as<int8_t>(piece_position_);
+            w->write_as<int8_t>(board_index_);
+            w->write(key_);
+            keys_.serialize(w);
+            w->write_as<Change>(changes_);
+            w->write_as<int16_t>(record_);
+        }
+
+        bool deserialize(BinaryReader *r)
+        {
+            int8_t color, win_color;
+            if (!r->read_as<int8_t>(&board_) || int(board_.size()) != B_) return false;
+            if (!r->read(&color) || !r->read(&win_color)) return false;
+            if (!r->read_as<int8_t>(&piece_cnt_) || !r->read_as<int8_t>(&piece_position_)) return false;
+            if (!r->read_as<int8_t>(&board_index_) || int(board_index_.size()) != B_) return false;
+            if (!r->read(&key_) || !keys_.deserialize(r)) return false;
+            if (!r->read_as<Change>(&changes_) || !r->read_as<int16_t>(&record_)) return false;
+            color_ = color;
+            win_color_ = win_color;
+            if (!valid_position()) return false;
+            if (changes_.size() != record_.size() || keys_.size() < record_.size()) return false;
+            for (size_t i = 0; i < record_.size(); i++) {
+                const Change& change = changes_[i];
+                if (record_[i] < 0 || record_[i] >= action_length()) return false;
+                if (change.piece_ < -1 || change.piece_ >= 4 || change.piece_index_ < -1 || change.piece_index_ >= 16) return false;
+                if (change.win_color_ < -1 || change.win_color_ > 2) return false;
+            }
+            reset_keys();
+            return true;
+        }
+
+        bool valid_position() const
+        {
+            // pieces, their indices and their squares agree with each other
+            if ((color_ != BLACK && color_ != WHITE) || win_color_ < -1 || win_color_ > 2) return false;
+            array<int, 4> count = {0, 0, 0, 0};
+            for (int pos = 0; pos < B_; pos++) {
+                int piece = board_[pos], index = board_index_[pos];
+                if (piece < -1 || piece >= 4 || index < -1 || index >= 16 || (piece < 0) != (index < 0)) return false;
+                if (piece < 0) continue;
+                if (piece2color(piece) != index / 8 || piece_position_[index] != pos || ++count[piece] > 4) return false;
+            }
+            for (int index = 0; index < 16; index++) {
+                int pos = piece_position_[index];
+                if (pos < -1 || pos >= B_ || (pos >= 0 && board_index_[pos] != index)) return false;
+            }
+            return true;
+        }
+
+        void reset_keys()
+        {
+            // piece counts and keys from the board
+            piece_cnt_.fill(0);
+            key_ = 0;
+            mirror_key_ = 0;
+            for (int pos = 0; pos < B_; pos++) {
+                int index = board_index_[pos];
+                if (index < 0) continue;
+                piece_cnt_[board_[pos]] += 1;
+                key_ ^= POSITION_KEY[pos][index];
+                mirror_key_ ^= POSITION_KEY[transform_position(1, pos)][MIRROR_INDEX[index]];
+            }
         }
 
         int colortype2piece(int c, int t) const
@@ -280,6 +443,7 @@ namespace Geister
             board_index_[pos] = piece_index;
             piece_cnt_[piece] += 1;
             key_ ^= POSITION_KEY[pos][piece_index];
+            mirror_key_ ^= POSITION_KEY[transform_position(1, pos)][MIRROR_INDEX[piece_index]];
         }
 
         void remove_piece(int pos)
@@ -291,6 +455,7 @@ namespace Geister
             piece_position_[piece_index] = -1;
             piece_cnt_[piece] -= 1;
             key_ ^= POSITION_KEY[pos][piece_index];
+            mirror_key_ ^= POSITION_KEY[transform_position(1, pos)][MIRROR_INDEX[piece_index]];
         }
 
         void move_piece(int pos_from, int pos_to)
@@ -304,6 +469,8 @@ namespace Geister
             piece_position_[piece_index] = pos_to;
             key_ ^= POSITION_KEY[pos_from][piece_index];
             key_ ^= POSITION_KEY[pos_to][piece_index];
+            mirror_key_ ^= POSITION_KEY[transform_position(1, pos_from)][MIRROR_INDEX[piece_index]];
+            mirror_key_ ^= POSITION_KEY[transform_position(1, pos_to)][MIRROR_INDEX[piece_index]];
         }
 
         bool goal(int color, int pos_from, int d) const
@@ -323,9 +490,12 @@ namespace Geister
             assert(legal(action));
             int pos_from = action2from(action);
             int d = action2direction(action);
+            Change change = {-1, -1, int8_t(win_color_)};
 
             if (!onboard_next(pos_from, d)) {
                 // finish by reaching goal position
+                change.piece_ = board_[pos_from];
+                change.piece_index_ = board_index_[pos_from];
                 remove_piece(pos_from);
                 win_color_ = color_;
             } else {
@@ -333,6 +503,8 @@ namespace Geister
                 int piece_cap = board_[pos_to];
                 if (piece_cap != -1) {
                     // capture opponent piece
+                    change.piece_ = piece_cap;
+                    change.piece_index_ = board_index_[pos_to];
                     remove_piece(pos_to);
                     if (piece_cnt_[piece_cap] == 0) {
                         if (piece2type(piece_cap) == BLUE) {
@@ -351,15 +523,40 @@ namespace Geister
 
             // repetition check
             long long key = key_ ^ color_;
-            prev_keys_[key] += 1;
+            keys_.push(key);
 
-            if (prev_keys_[key] >= 3) { // draw
+            if (keys_.count(key) >= 3) { // draw
                 win_color_ = 2;
             }
 
+            changes_.push_back(change);
             record_.push_back(action);
         }
 
+        void unchance() {}
+
+        void undo()
+        {
+            assert(!record_.empty());
+            int action = record_.back();
+            record_.pop_back();
+            Change change = changes_.back();
+            changes_.pop_back();
+            keys_.pop();
+            color_ = opponent(color_);
+
+            int pos_from = action2from(action);
+            int d = action2direction(action);
+            if (!onboard_next(pos_from, d)) {
+                put_piece(change.piece_, pos_from, change.piece_index_);
+            } else {
+                int pos_to = fromdirection2to(pos_from, d);
+                move_piece(pos_to, pos_from);
+                if (change.piece_ != -1) put_piece(change.piece_, pos_to, change.piece_index_);
+            }
+            win_color_ = change.win_color_;
+        }
+
         void plays(const string& s)
         {
             if (s.size() == 0) return;
@@ -367,6 +564,35 @@ namespace Geister
             for (const string& s : ss) play(str2action(s));
         }
 
+        long long key() const
+        {
+            // key_ ignores colors of pieces, which are fixed in a game but not across games
+            long long key = key_ ^ color_;
+            for (int index = 0; index < 16; index++) {
+                int pos = piece_position_[index];
+                if (pos >= 0 && piece2type(board_[pos]) == RED) {
+                    key ^= (long long)((unsigned long long)POSITION_KEY[pos][index] * 0x9E3779B97F4A7C15ULL);
+                }
+            }
+            return key;
+        }
+
+        pair<long long, int> canonical_hash() const
+        {
+            // a key shared by mirrored positions and the symmetry to the canonical one
+            array<long long, 2> keys = {key_ ^ color_, mirror_key_ ^ color_};
+            for (int index = 0; index < 16; index++) {
+                int pos = piece_position_[index];
+                if (pos >= 0 && piece2type(board_[pos]) == RED) {
+                    for (int sym = 0; sym < 2; sym++) {
+                        int p = transform_position(sym, pos), i = sym ? MIRROR_INDEX[index] : index;
+                        keys[sym] ^= (long long)((unsigned long long)POSITION_KEY[p][i] * 0x9E3779B97F4A7C15ULL);
+                    }
+                }
+            }
+            return smallest_key(keys.data(), 2);
+        }
+
         bool terminal() const
         {
             return win_color_ != -1;
@@ -374,9 +600,7 @@ namespace Geister
 
         float reward(bool subjective = true) const
         {
-            int r = 0;
-            if (win_color_ == color_) r = 1;
-            else if (win_color_ == opponent(color_)) r = -1;
+            int r = win_color_ == BLACK ? 1 : (win_color_ == WHITE ? -1 : 0);
             return subjective && color_ == WHITE ? -r : r;
         }
 
@@ -428,32 +652,173 @@ namespace Geister
             return 4 * B_;
         }
 
+        int symmetry_count() const
+        {
+            return 2; // mirror of files
+        }
+
+        int transform_position(int sym, int pos) const
+        {
+            int x = position2x(pos), y = position2y(pos);
+            transform_xy(sym, L_, L_, &x, &y);
+            return xy2position(x, y);
+        }
+
+        int transform_action(int sym, int action) const
+        {
+            int pos = transform_position(sym, action2from(action));
+            return fromdirection2action(pos, transform_direction(sym, action2direction(action)));
+        }
+
+        int feature_channels() const
+        {
+            return 8;
+        }
+
         vector<float> feature() const
         {
-            vector<float> f(8 * L_ * L_, 0.0f);
+            vector<float> f(feature_channels() * B_);
+            feature_into(f.data());
+            return f;
+        }
+
+        void feature_into(float *f) const
+        {
+            // feature_channels() planes written into f
+            fill(f, f + 8 * B_, 0.0f);
             int col = color_, opp = opponent(color_);
 
             int p[4] = {
                 colortype2piece(col, 0), colortype2piece(col, 1),
                 colortype2piece(opp, 0), colortype2piece(opp, 1)
             };
-            float c[4] = {
-                log2f((float)piece_cnt_[p[0]]), log2f((float)piece_cnt_[p[1]]),
-                log2f((float)piece_cnt_[p[2]]), log2f((float)piece_cnt_[p[3]])
-            };
 
+            if (color_ == BLACK) fill(f, f + B_, 1.0f);
             for (int pos = 0; pos < B_; pos++) {
-                if (color_ == BLACK) f[pos] = 1;
                 if (board_[pos] == p[0]) f[pos + B_] = 1;
                 if (board_[pos] == p[1]) f[pos + 2 * B_] = 1;
                 if (board_[pos] == p[2] || board_[pos] == p[3]) f[pos + 3 * B_] = 1;
-                f[pos + 4 * B_] = c[0];
-                f[pos + 5 * B_] = c[1];
-                f[pos + 6 * B_] = c[2];
-                f[pos + 7 * B_] = c[3];
             }
+            for (int i = 0; i < 4; i++) {
+                float c = log2f((float)piece_cnt_[p[i]]);
+                fill(f + (4 + i) * B_, f + (5 + i) * B_, c);
+            }
+        }
 
-            return f;
+        int observation_channels() const
+        {
+            return 12;
+        }
+
+        void observation(int player, float *f) const
+        {
+            // features visible to a player, written into f[12 * B_]
+            //  0    : the player is to move
+            //  1,  2: own blue, red pieces
+            //  3    : opponent pieces (colors unknown)
+            //  4,  5: own blue, red counts
+            //  6,  7: opponent blue, red counts
+            //  8,  9: squares where the player captured opponent blue, red pieces
+            // 10, 11: squares where the opponent captured own blue, red pieces
+            int opp = opponent(player);
+            fill(f, f + 12 * B_, 0.0f);
+            if (color_ == player) fill(f, f + B_, 1.0f);
+
+            for (int i = 0; i < 8; i++) {
+                int pos = piece_position_[player * 8 + i];
+                if (pos != -1) f[(1 + piece2type(board_[pos])) * B_ + pos] = 1;
+                pos = piece_position_[opp * 8 + i];
+                if (pos != -1) f[3 * B_ + pos] = 1;
+            }
+            for (int t = 0; t < 2; t++) {
+                float c = log2f((float)piece_cnt_[colortype2piece(player, t)]);
+                fill(f + (4 + t) * B_, f + (5 + t) * B_, c);
+                c = log2f((float)piece_cnt_[colortype2piece(opp, t)]);
+                fill(f + (6 + t) * B_, f + (7 + t) * B_, c);
+            }
+
+            // capture history
+            for (int i = 0; i < int(record_.size()); i++) {
+                int piece = changes_[i].piece_;
+                int pos_from = action2from(record_[i]);
+                int d = action2direction(record_[i]);
+                if (piece == -1 || !onboard_next(pos_from, d)) continue;
+                int index = (piece2color(piece) == opp ? 8 : 10) + piece2type(piece);
+                f[index * B_ + fromdirection2to(pos_from, d)] = 1;
+            }
+        }
+    };
+
+    static_assert(is_trivially_copyable<State::Position>::value, "Geister::State::Position must be plain memory");
+
+    // sampling of hidden colors of the opponent pieces seen from a player
+    // an assignment is a bit set over the 8 piece indices of the opponent (set = blue);
+    // captured pieces are revealed and goal moves end the game,
+    // so any choice of the remaining blue count among the living pieces is consistent
+    struct Determinizer
+    {
+        int player_;
+        int opponent_;
+        int alive_mask_;      // opponent pieces on the board; captured ones keep their color
+        int blue_count_;      // blue ones among them
+        vector<uint8_t> assignments_;
+
+        Determinizer(const State& s, int player):
+        player_(player),
+        opponent_(opponent(player)),
+        alive_mask_(0),
+        blue_count_(s.piece_cnt_[s.colortype2piece(opponent_, BLUE)])
+        {
+            for (int i = 0; i < 8; i++) {
+                if (s.piece_position_[opponent_ * 8 + i] != -1) alive_mask_ |= 1 << i;
+            }
+            for (int mask = 0; mask < 256; mask++) {
+                if (consistent(mask)) assignments_.push_back(mask);
+            }
+        }
+
+        bool consistent(int blue_mask) const
+        {
+            // whether blue_mask only marks pieces on the board, as many as the blue ones left
+            return blue_mask >= 0 && (blue_mask & ~alive_mask_) == 0 && popcnt(blue_mask) == blue_count_;
+        }
+
+        int size() const
+        {
+            return assignments_.size();
+        }
+
+        int sample(mt19937_64& mt) const
+        {
+            return assignments_[mt() % assignments_.size()];
+        }
+
+        void sample(mt19937_64& mt, int n, uint8_t *out) const
+        {
+            for (int i = 0; i < n; i++) out[i] = sample(mt);
+        }
+
+        void apply(State *s, int blue_mask) const
+        {
+            // in place; keys depend only on piece indices and do not change
+            for (int i = 0; i < 8; i++) {
+                int pos = s->piece_position_[opponent_ * 8 + i];
+                if (pos == -1) continue;
+                int piece = s->colortype2piece(opponent_, (blue_mask >> i & 1) ? BLUE : RED);
+                int old_piece = s->board_[pos];
+                if (piece == old_piece) continue;
+                s->piece_cnt_[old_piece] -= 1;
+                s->piece_cnt_[piece] += 1;
+                s->board_[pos] = piece;
+            }
+        }
+
+        vector<State> sample_states(const State& s, int n, long long seed) const
+        {
+            mt19937_64 mt(seed);
+            vector<State> states(n, s);
+            for (auto& st : states) apply(&st, sample(mt));
+            return states;
         }
     };
 }
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <set>
+#include <cmath>
+#include <random>
+#include <mutex>
+#include <type_traits>
+
 #include "util.hpp"
 #include "boardgame.hpp"
+#include "symmetry.hpp"
 
 using namespace std;
 
@@ -25,16 +32,16 @@ namespace Go
             };
             start(args[0], args);
         }
-        string communicate(const string& str) {
-            printline(str.c_str());
-            string line;
-            while (!contains(line, "=")) getline(&line);
-            return line;
+        bool communicate(const string& str, string *response = nullptr) {
+            // false for an error response, a timeout or a dead process
+            string r;
+            return request(str, response ? response : &r, 10000) == SUCCESS;
         }
     };
 
     bool use_gnugo = true;
     GNUGo *gnugo = nullptr;
+    mutex gnugo_mutex; // scoring may be called from several threads
 
     void open_gnugo(bool japanese) {
         gnugo = new GNUGo(japanese);
@@ -48,9 +55,18 @@ namespace Go
 
     array<Entry, 65536 + 3> scores;
 
+    constexpr int MAX_B = 25 * 25;
+    long long STONE_KEY[MAX_B][3]; // black, white and ko of each point
+
     inline void init()
     {
         memset(scores.data(), 0, sizeof(scores));
+        mt19937_64 mt(0);
+        for (int pos = 0; pos < MAX_B; pos++) {
+            STONE_KEY[pos][0] = mt();
+            STONE_KEY[pos][1] = mt();
+            STONE_KEY[pos][2] = mt();
+        }
     }
 
     struct Ren {
@@ -76,7 +92,6 @@ namespace Go
         float komi_;
         bool superko_;
         bool japanese_;
-        vector<array<long long, 3>> STONE_KEY_;
 
         vector<int> board_;
         int color_;
@@ -87,6 +102,21 @@ namespace Go
         long long position_key_;
         set<long long> position_keys_;
         vector<int> record_;
+        int plies_, passes_; // also counted for positions set without their record
+        array<long long, 8> symmetric_keys_; // position_key_ of the board seen through each symmetry
+
+        // plain memory snapshot of a position; strings, history for superko and the record are left out
+        struct Position
+        {
+            int8_t lx_, ly_;
+            int8_t superko_, japanese_;
+            float komi_;
+            array<int8_t, MAX_B> board_;
+            int8_t color_;
+            int16_t ko_, plies_, passes_;
+            long long position_key_;
+            array<long long, 8> symmetric_keys_;
+        };
 
         State()
         {
@@ -95,15 +125,6 @@ namespace Go
             komi_ = 7.0;
             superko_ = false;
             japanese_ = false;
-
-            STONE_KEY_.resize(B_);
-            mt19937_64 mt(0);
-            for (int pos = 0; pos < B_; pos++) {
-                STONE_KEY_[pos][0] = mt();
-                STONE_KEY_[pos][1] = mt();
-                STONE_KEY_[pos][2] = mt();
-            }
-
             clear();
         }
 
@@ -114,7 +135,6 @@ namespace Go
         komi_(s.komi_),
         superko_(s.superko_),
         japanese_(s.japanese_),
-        STONE_KEY_(s.STONE_KEY_),
         board_(s.board_),
         color_(s.color_),
         ko_(s.ko_),
@@ -123,7 +143,10 @@ namespace Go
         ren_id_(s.ren_id_),
         position_key_(s.position_key_),
         position_keys_(s.position_keys_),
-        record_(s.record_) {}
+        record_(s.record_),
+        plies_(s.plies_),
+        passes_(s.passes_),
+        symmetric_keys_(s.symmetric_keys_) {}
 
         array<int, 2> size() const
         {
@@ -147,6 +170,137 @@ namespace Go
             position_key_ = -1;
             position_keys_.clear();
             record_.clear();
+            plies_ = passes_ = 0;
+            symmetric_keys_.fill(-1);
+        }
+
+        Position position() const
+        {
+            Position p;
+            p.lx_ = LX_;
+            p.ly_ = LY_;
+            p.superko_ = superko_;
+            p.japanese_ = japanese_;
+            p.komi_ = komi_;
+            p.board_.fill(EMPTY);
+            copy(board_.begin(), board_.end(), p.board_.begin());
+            p.color_ = color_;
+            p.ko_ = ko_;
+            p.plies_ = plies_;
+            p.passes_ = passes_;
+            p.position_key_ = position_key_;
+            p.symmetric_keys_ = symmetric_keys_;
+            return p;
+        }
+
+        bool set_position(const Position& p)
+        {
+            // strings and keys are rebuilt from the board; the record starts here
+            if (p.lx_ < 1 || p.lx_ > 25 || p.ly_ != p.lx_) return false; // square boards only
+            if (uint8_t(p.superko_) > 1 || uint8_t(p.japanese_) > 1 || !std::isfinite(p.komi_)) return false;
+            if (p.plies_ < 0 || p.passes_ < 0 || p.passes_ > p.plies_) return false;
+            for (int pos = p.lx_ * p.ly_; pos < MAX_B; pos++) {
+                if (p.board_[pos] != EMPTY) return false;
+            }
+            LX_ = p.lx_;
+            LY_ = p.ly_;
+            B_ = LX_ * LY_;
+            superko_ = p.superko_;
+            japanese_ = p.japanese_;
+            komi_ = p.komi_;
+            if (!set_board(vector<int>(p.board_.begin(), p.board_.begin() + B_), p.color_, p.ko_)) return false;
+            plies_ = p.plies_;
+            passes_ = p.passes_;
+            position_keys_.insert(position_key_);
+            return true;
+        }
+
+        bool set_board(const vector<int>& board, int color, int ko)
+        {
+            // strings and keys from the board; false unless every string has a liberty
+            if ((color != BLACK && color != WHITE) || ko < -1 || ko >= B_) return false;
+            for (int pos = 0; pos < B_; pos++) {
+                if (board[pos] != BLACK && board[pos] != WHITE && board[pos] != EMPTY) return false;
+            }
+            clear();
+            copy(board.begin(), board.begin() + B_, board_.begin());
+            for (int pos = 0; pos < B_; pos++) {
+                if (board_[pos] == EMPTY) continue;
+                ren_[pos].clear(STONE_KEY[pos][board_[pos]]);
+                position_key_ ^= STONE_KEY[pos][board_[pos]];
+                toggle_stone_key(pos, board_[pos]);
+            }
+            for (int pos = 0; pos < B_; pos++) {
+                if (board_[pos] == EMPTY) continue;
+                int x = action2x(pos), y = action2y(pos);
+                for (int d = 0; d < 4; d++) {
+                    int nx = x + D2[d][0], ny = y + D2[d][1];
+                    if (!onboard_xy(nx, ny, LX_, LY_)) continue;
+                    int npos = xy2action(nx, ny);
+                    if (board_[npos] == EMPTY) {
+                        ren_[ren_id_[pos]].libs_.insert(npos);
+                    } else if (board_[npos] == board_[pos] && ren_id_[pos] != ren_id_[npos]) {
+                        merge_ren(pos, npos);
+                    }
+                }
+            }
+            for (int pos = 0; pos < B_; pos++) {
+                if (board_[pos] != EMPTY && ren_[ren_id_[pos]].libs_.empty()) return false;
+            }
+            if (ko >= 0 && board_[ko] != EMPTY) return false;
+            color_ = color;
+            ko_ = ko;
+            return true;
+        }
+
+        void serialize(BinaryWriter *w) const
+        {
+            w->write(LX_);
+            w->write(LY_);
+            w->write(komi_);
+            w->write(superko_);
+            w->write(japanese_);
+            w->write_as<int8_t>(board_);
+            w->write(int8_t(color_));
+            w->write(int16_t(ko_));
+            w->write_as<long long>(position_keys_);
+            w->write_as<int16_t>(record_);
+        }
+
+        bool deserialize(BinaryReader *r)
+        {
+            // the board size is fixed by the constructor; strings and keys are rebuilt from the board
+            int lx, ly;
+            float komi;
+            uint8_t superko, japanese;
+            vector<int> board, record;
+            int8_t color;
+            int16_t ko;
+            if (!r->read(&lx) || !r->read(&ly) || lx != LX_ || ly != LY_) return false;
+            if (!r->read(&komi) || !std::isfinite(komi) || !r->read(&superko) || !r->read(&japanese)) return false;
+            if (superko > 1 || japanese > 1) return false;
+            if (!r->read_as<int8_t>(&board) || int(board.size()) != B_) return false;
+            if (!r->read(&color) || !r->read(&ko)) return false;
+            vector<long long> keys;
+            if (!r->read_as<long long>(&keys)) return false;
+            if (!r->read_as<int16_t>(&record)) return false;
+            for (int action : record) {
+                if (action < 0 || action > B_) return false;
+            }
+            if (!set_board(board, color, ko)) return false;
+            komi_ = komi;
+            superko_ = superko;
+            japanese_ = japanese;
+            position_keys_ = set<long long>(keys.begin(), keys.end());
+            record_ = record;
+            plies_ = record_.size();
+            for (passes_ = 0; passes_ < plies_ && record_[plies_ - 1 - passes_] == B_; passes_++) {}
+            return true;
+        }
+
+        void toggle_stone_key(int pos, int color)
+        {
+            for (int sym = 0; sym < 8; sym++) symmetric_keys_[sym] ^= STONE_KEY[transform_position(sym, pos)][color];
         }
 
         string action2str(int action) const
@@ -208,9 +362,10 @@ namespace Go
                 board_[action] = color_;
                 ren_id_[action] = action;
 
-                long long stone_key = STONE_KEY_[action][color_];
+                long long stone_key = STONE_KEY[action][color_];
                 ren_[ren_id_[action]].clear(stone_key);
                 position_key_ ^= stone_key;
+                toggle_stone_key(action, color_);
 
                 int x = action2x(action), y = action2y(action);
                 for (int d = 0; d < 4; d++) {
@@ -256,6 +411,8 @@ namespace Go
             }
             color_ = opponent(color_);
             record_.push_back(action);
+            plies_ += 1;
+            passes_ = action == B_ ? passes_ + 1 : 0;
         }
 
         int remove_ren(int pos) {
@@ -265,6 +422,7 @@ namespace Go
             ren_[ren_id].size_ = 0;
             int tpos = pos;
             while (1) {
+                toggle_stone_key(tpos, board_[tpos]);
                 board_[tpos] = EMPTY;
                 ren_id_[tpos] = tpos;
                 int x = action2x(tpos), y = action2y(tpos);
@@ -306,14 +464,31 @@ namespace Go
             for (const string& s : ss) play(str2action(s));
         }
 
+        long long key() const
+        {
+            // stones, ko and the color to move
+            long long key = position_key_ ^ color_;
+            if (ko_ != -1) key ^= STONE_KEY[ko_][2];
+            return key;
+        }
+
+        pair<long long, int> canonical_hash() const
+        {
+            // a key shared by symmetric positions and the symmetry to the canonical one
+            array<long long, 8> keys;
+            for (int sym = 0; sym < 8; sym++) {
+                keys[sym] = symmetric_keys_[sym] ^ color_;
+                if (ko_ != -1) keys[sym] ^= STONE_KEY[transform_position(sym, ko_)][2];
+            }
+            return smallest_key(keys.data(), 8);
+        }
+
         bool terminal() const
         {
             // ignore 3-ko infinite games
-            if (record_.size() >= B_ * 3) return true;
+            if (plies_ >= B_ * 3) return true;
             // consecutive passes
-            return record_.size() >= 2
-                && record_.back() == B_
-                && record_[record_.size() - 2] == B_;
+            return passes_ >= 2;
         }
 
         float reward(bool subjective = true) const
@@ -370,15 +545,106 @@ namespace Go
             return B_ + 1;
         }
 
+        int symmetry_count() const
+        {
+            return 8;
+        }
+
+        int transform_position(int sym, int pos) const
+        {
+            int x = action2x(pos), y = action2y(pos);
+            transform_xy(sym, LX_, LY_, &x, &y);
+            return xy2action(x, y);
+        }
+
+        int transform_action(int sym, int action) const
+        {
+            if (action == B_) return action; // pass
+            return transform_position(sym, action);
+        }
+
+        int feature_channels() const
+        {
+            return 3;
+        }
+
         vector<float> feature() const
         {
-            vector<float> f(3 * LX_ * LY_, 0.0f);
+            vector<float> f(feature_channels() * B_);
+            feature_into(f.data());
+            return f;
+        }
+
+        void feature_into(float *f) const
+        {
+            // feature_channels() planes written into f
+            fill(f, f + 3 * B_, 0.0f);
             for (int pos = 0; pos < B_; pos++) {
                 if (board_[pos] == color_)           f[pos] = 1;
                 if (board_[pos] == opponent(color_)) f[pos + B_] = 1;
                 if (color_ == BLACK) f[pos + B_ * 2] = 1;
             }
-            return f;
+        }
+
+        bool gnugo_score(float *sc) const
+        {
+            if (!gnugo) open_gnugo(japanese_);
+            bool ok = gnugo->communicate("boardsize " + std::to_string(LX_))
+                   && gnugo->communicate("komi " + std::to_string(komi_))
+                   && gnugo->communicate("clear_board");
+            int color = BLACK;
+            for (int action : record_) {
+                if (!ok) break;
+                ok = gnugo->communicate(string("play ") + CC[color] + " " + action2str(action));
+                color = opponent(color);
+            }
+            string score_str;
+            if (ok && gnugo->communicate("final_score", &score_str) && score_str.size() >= 2) {
+                float abs_sc = score_str[0] == '0' ? 0 : stof(score_str.substr(2));
+                *sc = score_str[0] == 'W' ? -abs_sc : abs_sc;
+                return true;
+            }
+            // restart at the next call
+            delete gnugo;
+            gnugo = nullptr;
+            return false;
+        }
+
+        float area_score() const
+        {
+            // stones and surrounded empty points of black minus those of white and komi
+            float sc = -komi_;
+            vector<int> region(B_, -1);
+            for (int pos = 0; pos < B_; pos++) {
+                if (board_[pos] == BLACK) sc += 1;
+                if (board_[pos] == WHITE) sc -= 1;
+                if (board_[pos] != EMPTY || region[pos] >= 0) continue;
+                vector<int> stack = {pos};
+                int cnt = 0, touch = 0;
+                region[pos] = pos;
+                while (!stack.empty()) {
+                    int p = stack.back();
+                    stack.pop_back();
+                    cnt++;
+                    int x = action2x(p), y = action2y(p);
+                    for (int d = 0; d < 4; d++) {
+                        int nx = x + D2[d][0], ny = y + D2[d][1];
+                        if (!onboard_xy(nx, ny, LX_, LY_)) continue;
+                        int q = xy2action(nx, ny);
+                        if (board_[q] == EMPTY) {
+                            if (region[q] < 0) {
+                                region[q] = pos;
+                                stack.push_back(q);
+                            }
+                        } else {
+                            touch |= 1 << board_[q];
+                        }
+                    }
+                }
+                if (touch == 1 << BLACK) sc += cnt;
+                if (touch == 1 << WHITE) sc -= cnt;
+            }
+            return sc;
         }
 
         int score(bool subjective = true) const
@@ -386,34 +652,25 @@ namespace Go
             float sc = 0;
 
             unsigned long long state_key = position_key_;
-            if (ko_ != -1) state_key ^= STONE_KEY_[ko_][2];
+            if (ko_ != -1) state_key ^= STONE_KEY[ko_][2];
             state_key ^= color_;
+            lock_guard<mutex> lock(gnugo_mutex);
             int index = state_key % scores.size();
             Entry e = scores[index];
 
             if (e.key_ >> 16 == state_key >> 16) {
                 sc = e.s_[0] / 2.0f;
             } else {
-                if (!gnugo) open_gnugo(japanese_);
-
-                gnugo->communicate("name");
-                gnugo->communicate("boardsize " + std::to_string(LX_));
-                gnugo->communicate("komi " + std::to_string(komi_));
-                gnugo->communicate("clear_board");
-                int color = BLACK;
-                for (int action : record_) {
-                    ostringstream oss;
-                    oss << "play " << CC[color] << " " << action2str(action);
-                    gnugo->communicate(oss.str());
-                    color = opponent(color);
+                // GNU Go replays the record, which positions set by set_position() lack;
+                // only its scores are cached, so that a failed call is retried next time
+                bool replayable = int(record_.size()) == plies_;
+                if (use_gnugo && replayable && gnugo_score(&sc)) {
+                    e.key_ = (state_key >> 16) << 16;
+                    e.s_[0] = sc * 2;
+                    scores[index] = e;
+                } else {
+                    sc = area_score();
                 }
-                string score_str = gnugo->communicate("final_score");
-                float abs_sc = stof(split(split(strip(score_str, '\n'), ' ')[1], '+').back());
-                sc = contains(score_str, "W+") ? -abs_sc : abs_sc;
-
-                e.key_ = (state_key >> 16) << 16;
-                e.s_[0] = sc * 2;
-                scores[index] = e;
             }
 
             if (subjective && color_ == WHITE) sc = -sc;
@@ -438,7 +695,7 @@ namespace Go
         long long next_position_key(int action) const {
             assert(onboard(action, LX_, LY_));
             long long next_key = position_key_;
-            next_key ^= STONE_KEY_[color_][action];
+            next_key ^= STONE_KEY[action][color_];
             int x = action2x(action), y = action2y(action);
             for (int d = 0; d < 4; d++) {
                 int nx = x + D2[d][0], ny = y + D2[d][1];
@@ -452,4 +709,6 @@ namespace Go
             return next_key;
         }
     };
+
+    static_assert(is_trivially_copyable<State::Position>::value, "Go::State::Position must be plain memory");
 }
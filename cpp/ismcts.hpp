@@ -0,0 +1,202 @@
+#pragma once
+
+// information set Monte Carlo tree search for Geister
+// one tree seen by the searching player is shared by all determinizations,
+// and nodes are found by the public position key (Zobrist keys over piece indices)
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#include "geister.hpp"
+
+using namespace std;
+
+namespace Geister
+{
+    struct ISMCTS
+    {
+        static constexpr int EDGES = 8 * 4; // piece index x direction
+
+        struct Edge
+        {
+            atomic<int> visits_;
+            atomic<int> available_;
+            atomic<int> value_; // sum of rewards of the player to move
+        };
+
+        struct Node
+        {
+            atomic<long long> key_;
+            Edge edges_[EDGES];
+        };
+
+        float c_;
+        int max_playout_;
+        int max_nodes_; // of the arena, whatever the number of simulations
+
+        vector<Node> nodes_;        // shared arena
+        atomic<int> node_count_;
+        vector<atomic<int>> table_; // node index + 1 (0 for empty)
+        int table_mask_;
+
+        ISMCTS(float c = 1.0f, int max_playout = 300, int max_nodes = 1 << 17):
+        c_(c),
+        max_playout_(max_playout),
+        max_nodes_(max_nodes),
+        node_count_(0),
+        table_mask_(0) {}
+
+        static long long info_key(const State& s)
+        {
+            // revealed colors of captured pieces are public as well
+            int b0 = s.piece_cnt_[s.colortype2piece(BLACK, BLUE)];
+            int b1 = s.piece_cnt_[s.colortype2piece(WHITE, BLUE)];
+            return s.key_ ^ s.color_ ^ (long long)(0x9E3779B97F4A7C15ULL * (1 + b0 + 5 * b1));
+        }
+
+        static int edge_index(const State& s, int action)
+        {
+            int piece_index = s.board_index_[s.action2from(action)];
+            return (piece_index % 8) * 4 + s.action2direction(action);
+        }
+
+        void reset(int capacity)
+        {
+            nodes_ = vector<Node>(capacity);
+            node_count_ = 0;
+            int size = 1;
+            while (size < capacity * 2) size *= 2;
+            table_ = vector<atomic<int>>(size);
+            for (auto& t : table_) t.store(0, memory_order_relaxed);
+            table_mask_ = size - 1;
+        }
+
+        int find(long long key, bool create)
+        {
+            // lock-free open addressing; a node losing an insertion race is left unused
+            int i = (unsigned long long)key * 0x9E3779B97F4A7C15ULL >> 32 & table_mask_;
+            int created = -1;
+            while (true) {
+                int index = table_[i].load(memory_order_acquire);
+                if (index == 0) {
+                    if (!create) return -1;
+                    if (created < 0) {
+                        created = node_count_.fetch_add(1);
+                        if (created >= int(nodes_.size())) return -1;
+                        Node& node = nodes_[created];
+                        node.key_.store(key, memory_order_relaxed);
+                        for (auto& e : node.edges_) {
+                            e.visits_.store(0, memory_order_relaxed);
+                            e.available_.store(0, memory_order_relaxed);
+                            e.value_.store(0, memory_order_relaxed);
+                        }
+                    }
+                    if (table_[i].compare_exchange_strong(index, created + 1, memory_order_acq_rel)) {
+                        return created;
+                    }
+                }
+                if (nodes_[index - 1].key_.load(memory_order_relaxed) == key) return index - 1;
+                i = (i + 1) & table_mask_;
+            }
+        }
+
+        int select(Node& node, const State& s, const vector<int>& actions, mt19937_64& mt)
+        {
+            int best = -1;
+            float best_score = -1e10;
+            for (int action : actions) {
+                Edge& e = node.edges_[edge_index(s, action)];
+                int available = e.available_.fetch_add(1, memory_order_relaxed) + 1;
+                int n = e.visits_.load(memory_order_relaxed);
+                float score;
+                if (n == 0) {
+                    score = 1e6f + (mt() % 1024);
+                } else {
+                    float q = e.value_.load(memory_order_relaxed) / float(n);
+                    score = q + c_ * sqrt(log(float(available)) / n);
+                }
+                if (score > best_score) {
+                    best_score = score;
+                    best = action;
+                }
+            }
+            return best;
+        }
+
+        void simulate(State& s, const Determinizer& determinizer, mt19937_64& mt)
+        {
+            determinizer.apply(&s, determinizer.sample(mt));
+            int plies = 0;
+            vector<pair<Edge*, int>> path;
+
+            // selection and expansion
+            while (!s.terminal()) {
+                long long key = info_key(s);
+                int index = find(key, false);
+                bool expand = index < 0;
+                if (expand) index = find(key, true);
+                if (index < 0) break; // arena is full
+
+                vector<int> actions = s.legal_actions();
+                int action = select(nodes_[index], s, actions, mt);
+                Edge& e = nodes_[index].edges_[edge_index(s, action)];
+                e.visits_ += 1;
+                e.value_ -= 1; // virtual loss
+                path.emplace_back(&e, s.color_);
+                s.play(action);
+                plies++;
+                if (expand) break;
+            }
+
+            // playout
+            for (int i = 0; i < max_playout_ && !s.terminal(); i++) {
+                vector<int> actions = s.legal_actions();
+                s.play(actions[mt() % actions.size()]);
+                plies++;
+            }
+
+            float r = s.terminal() ? s.reward(false) : 0;
+            for (auto& p : path) {
+                int v = p.second == BLACK ? int(r) : -int(r);
+                p.first->value_ += v + 1;
+            }
+            for (int i = 0; i < plies; i++) s.undo();
+        }
+
+        vector<int> search(const State& root, int simulations, int threads = 1, long long seed = 0,
+                           double seconds = -1)
+        {
+            // visit counts of root actions (indexed by action)
+            // within the number of simulations and the time limit (if positive)
+            // a simulation adds at most one node; the tree stops growing once the arena is full
+            reset(max(1, min(simulations, max_nodes_ - 1) + 1));
+            Determinizer determinizer(root, root.color_);
+            atomic<int> count(0);
+            auto start = chrono::steady_clock::now();
+
+            vector<thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t]() {
+                    mt19937_64 mt(seed + t);
+                    State s(root);
+                    for (int n = 0; count++ < simulations; n++) {
+                        if (seconds > 0 && (n & 15) == 0
+                            && chrono::duration<double>(chrono::steady_clock::now() - start).count() >= seconds) break;
+                        simulate(s, determinizer, mt);
+                    }
+                });
+            }
+            for (auto& w : workers) w.join();
+
+            vector<int> visits(root.action_length(), 0);
+            int index = find(info_key(root), false);
+            if (index < 0) return visits;
+            for (int action : root.legal_actions()) {
+                visits[action] = nodes_[index].edges_[edge_index(root, action)].visits_;
+            }
+            return visits;
+        }
+    };
+}
@@ -1,3 +1,5 @@
+#include <memory>
+
 #include "util.hpp"
 #include "search.hpp"
 #include "tictactoe.hpp"
@@ -6,11 +8,59 @@
 #include "go.hpp"
 #include "geister.hpp"
 #include "fliptictactoe.hpp"
+#include "record.hpp"
+#include "shard.hpp"
+#include "replay.hpp"
 
 using namespace std;
 
 // executable
 
+template <class state_t>
+bool check_records(const string& name)
+{
+    // random games written to a stream of records and replayed from it
+    vector<state_t> states(10);
+    ostringstream oss;
+    Record::StreamWriter writer(oss);
+    for (int i = 0; i < int(states.size()); i++) {
+        state_t& state = states[i];
+        clear_state(state, i);
+        while (!state.terminal()) {
+            auto actions = state.legal_actions();
+            if (actions.empty()) break;
+            state.play(actions[rand() % actions.size()]);
+            if (!state.terminal()) state.chance(rand());
+        }
+        writer.write(state);
+    }
+    istringstream iss(oss.str());
+    Record::StreamReader reader(iss);
+    for (const state_t& state : states) {
+        state_t replayed;
+        BinaryWriter w0, w1;
+        bool ok = reader.read(&replayed);
+        state.serialize(&w0);
+        replayed.serialize(&w1);
+        if (!ok || w0.data_ != w1.data_) {
+            cerr << name << " record differs after a round trip" << endl;
+            return false;
+        }
+    }
+    state_t extra;
+    if (reader.read(&extra)) {
+        cerr << name << " records continue after the end" << endl;
+        return false;
+    }
+    istringstream broken(string(9, '\xff') + '\x01');
+    Record::StreamReader broken_reader(broken);
+    if (broken_reader.next()) {
+        cerr << name << " record of a broken length is read" << endl;
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     srand(0);
@@ -82,6 +132,30 @@ int main(int argc, char *argv[])
         cerr << "reward = " << state.reward(false) << endl;
     }
 
+    for (int i = 0; i < 10; i++) {
+        // mirrored games share canonical hashes
+        Geister::State state, mirror;
+        state.clear(i);
+        array<int, 2> setup = state.setup(), mirror_setup = {0, 0};
+        for (int index = 0; index < 16; index++) {
+            int j = Geister::MIRROR_INDEX[index];
+            if (setup[index / 8] >> (index % 8) & 1) mirror_setup[j / 8] |= 1 << (j % 8);
+        }
+        mirror.set_setup(mirror_setup);
+        while (true) {
+            if (state.canonical_hash().first != mirror.canonical_hash().first) {
+                cerr << "canonical hash differs from the mirrored position" << endl;
+                cerr << state.to_string() << endl;
+                return 1;
+            }
+            if (state.terminal()) break;
+            auto actions = state.legal_actions();
+            int action = actions[rand() % actions.size()];
+            mirror.play(state.transform_action(1, action));
+            state.play(action);
+        }
+    }
+
     FlipTicTacToe::init();
     for (int i = 0; i < 10; i++) {
         FlipTicTacToe::State state;
@@ -97,4 +171,141 @@ int main(int argc, char *argv[])
         cerr << state.to_string() << endl;
         cerr << "reward = " << state.reward(false) << endl;
     }
+
+    if (!check_records<TicTacToe::State>("TicTacToe")
+        || !check_records<Reversi::State>("Reversi")
+        || !check_records<AnimalShogi::State>("AnimalShogi")
+        || !check_records<Go::State>("Go")
+        || !check_records<Geister::State>("Geister")
+        || !check_records<FlipTicTacToe::State>("FlipTicTacToe")) {
+        return 1;
+    }
+
+    {
+        // training records written in several chunks of a shard and read back
+        string path = "/tmp/main-" + to_string(getpid()) + ".shard";
+        vector<string> records;
+        Shard::Writer writer;
+        if (!writer.open(path, "TicTacToe", 7)) return 1;
+        for (int i = 0; i < 10; i++) {
+            TicTacToe::State state;
+            while (!state.terminal()) {
+                auto actions = state.legal_actions();
+                vector<float> policy(actions.size(), 1.0f / actions.size());
+                records.emplace_back();
+                Shard::encode_record(state, actions, policy, i % 3 - 1, &records.back());
+                writer.add(records.back());
+                state.play(actions[rand() % actions.size()]);
+            }
+        }
+        if (!writer.close()) return 1;
+        Shard::Reader reader;
+        bool ok = reader.open(path) && reader.game() == "TicTacToe" && reader.records() == records.size()
+               && reader.chunks() == (records.size() + 6) / 7;
+        for (size_t i = 0; ok && i < records.size(); i++) {
+            string record;
+            TicTacToe::State state;
+            vector<int> actions;
+            vector<float> policy;
+            float value;
+            ok = reader.read(i, &record) && record == records[i]
+              && Shard::decode_record(record, &state, &actions, &policy, &value);
+        }
+        string record;
+        ok = ok && !reader.read(records.size(), &record);
+        reader.close();
+        if (ok && truncate(path.c_str(), sizeof(Shard::Header) + 8) == 0) {
+            // an unfinished shard has no index and is rejected
+            ok = !reader.open(path);
+        }
+        unlink(path.c_str());
+        if (!ok) {
+            cerr << "shard records differ after a round trip" << endl;
+            return 1;
+        }
+    }
+
+    {
+        // replay buffer filled by several processes at once; positions added again are merged
+        const int processes = 4, additions = 50, keys = 20, n = TicTacToe::B;
+        string name = "/gi-main-" + to_string(getpid());
+        Replay::Buffer buffer;
+        if (!buffer.create(name, "TicTacToe", 256, n, 16)) return 1;
+        vector<pid_t> children;
+        for (int p = 0; p < processes; p++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                Replay::Buffer b;
+                if (!b.open(name)) _exit(1);
+                for (int i = 0; i < additions; i++) {
+                    int key = (p * 7 + i) % keys + 1;
+                    vector<float> policy(n, 0);
+                    policy[key % n] = 1;
+                    if (b.add(key, "state " + to_string(key), policy.data(), 1) < 0) _exit(1);
+                }
+                _exit(0);
+            }
+            children.push_back(pid);
+        }
+        bool ok = true;
+        for (pid_t pid : children) {
+            int status;
+            ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ok;
+        }
+        int counts = 0;
+        for (uint64_t i = 0; ok && i < buffer.size(); i++) {
+            string state;
+            vector<float> policy(n);
+            float value;
+            int count;
+            if (!buffer.read(i, &state, policy.data(), &value, &count)) continue;
+            long long key = buffer.slot(i).key_.load();
+            ok = state == "state " + to_string(key) && value == 1 && policy[key % n] == 1;
+            counts += count;
+        }
+        ok = ok && counts == processes * additions
+          && buffer.header_->additions_.load() == uint64_t(processes * additions);
+        for (int k = 0; ok && k < 100; k++) {
+            long long i = buffer.sample(k / 100.0);
+            string state;
+            vector<float> policy(n);
+            float value;
+            ok = i >= 0 && buffer.read(i, &state, policy.data(), &value);
+        }
+        buffer.unlink();
+        if (!ok) {
+            cerr << "replay buffer differs from the positions added" << endl;
+            return 1;
+        }
+    }
+
+    {
+        // lines of several child processes are read from one thread
+        vector<unique_ptr<Process>> children;
+        vector<Process*> processes;
+        for (int i = 0; i < 4; i++) {
+            char cat[] = "cat";
+            char *argv[] = {cat, nullptr};
+            children.emplace_back(new Process());
+            if (children.back()->start("cat", argv) <= 0) return 1;
+            processes.push_back(children.back().get());
+        }
+        for (int i = 3; i >= 0; i--) processes[i]->printline("line " + to_string(i));
+        int received = 0;
+        while (received < 4) {
+            vector<int> ready = poll_lines(processes, 1000);
+            if (ready.empty()) {
+                cerr << "no line from child processes" << endl;
+                return 1;
+            }
+            for (int i : ready) {
+                string line;
+                if (processes[i]->readline(&line, 0) != Process::SUCCESS || line != "line " + to_string(i)) {
+                    cerr << "unexpected line from child process " << i << endl;
+                    return 1;
+                }
+                received++;
+            }
+        }
+    }
 }
@@ -0,0 +1,177 @@
+#pragma once
+
+// Monte Carlo tree search with UCB1 and random playouts
+// nodes are open loop (chance events after each action are sampled),
+// so edges are added for whatever actions are legal when a node is reached;
+// the tree below the played action is kept by advance()
+
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+
+#include "util.hpp"
+#include "boardgame.hpp"
+
+using namespace std;
+
+template <class state_t>
+struct MCTS
+{
+    struct Edge
+    {
+        int action_;
+        int visits_;
+        float value_; // sum of rewards of the player to move
+        int child_;
+    };
+
+    struct Node
+    {
+        vector<Edge> edges_;
+        int visits_;
+    };
+
+    float c_;
+    int max_playout_;
+    size_t max_nodes_;
+    vector<Node> nodes_;
+    int root_;
+    mt19937_64 mt_;
+
+    MCTS(float c = 1.0f, int max_playout = 300, size_t max_nodes = 1 << 20, long long seed = 0):
+    c_(c),
+    max_playout_(max_playout),
+    max_nodes_(max_nodes),
+    mt_(seed)
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        nodes_.assign(1, Node{vector<Edge>(), 0});
+        root_ = 0;
+    }
+
+    void advance(int action)
+    {
+        // the old tree stays in the arena until it fills up
+        for (const Edge& e : nodes_[root_].edges_) {
+            if (e.action_ == action && e.child_ >= 0 && nodes_.size() < max_nodes_) {
+                root_ = e.child_;
+                return;
+            }
+        }
+        clear();
+    }
+
+    void play(state_t& s, int action)
+    {
+        s.play(action);
+        if (!s.terminal()) s.chance(int(mt_() >> 33));
+    }
+
+    int select(int index, const vector<int>& actions)
+    {
+        // an edge index of a legal action, adding edges on first sight
+        Node& node = nodes_[index];
+        int best = -1;
+        float best_score = -1e10;
+        for (int action : actions) {
+            int i = 0;
+            while (i < int(node.edges_.size()) && node.edges_[i].action_ != action) i++;
+            if (i == int(node.edges_.size())) node.edges_.push_back(Edge{action, 0, 0, -1});
+            const Edge& e = node.edges_[i];
+            float score;
+            if (e.visits_ == 0) {
+                score = 1e6f + (mt_() % 1024);
+            } else {
+                score = e.value_ / e.visits_ + c_ * sqrt(log(float(node.visits_ + 1)) / e.visits_);
+            }
+            if (score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    void simulate(const state_t& root)
+    {
+        state_t s(root);
+        vector<pair<int, int>> path; // (node, edge)
+        vector<int> colors;
+        int index = root_;
+
+        // selection and expansion
+        while (!s.terminal()) {
+            vector<int> actions = s.legal_actions();
+            if (actions.empty()) break;
+            int i = select(index, actions);
+            path.emplace_back(index, i);
+            colors.push_back(s.color_);
+            play(s, nodes_[index].edges_[i].action_);
+            int child = nodes_[index].edges_[i].child_;
+            if (child < 0) {
+                if (nodes_.size() < max_nodes_) {
+                    nodes_.push_back(Node{vector<Edge>(), 0});
+                    nodes_[index].edges_[i].child_ = nodes_.size() - 1;
+                }
+                break;
+            }
+            index = child;
+        }
+
+        // playout
+        for (int i = 0; i < max_playout_ && !s.terminal(); i++) {
+            vector<int> actions = s.legal_actions();
+            if (actions.empty()) break;
+            play(s, actions[mt_() % actions.size()]);
+        }
+
+        float r = s.terminal() ? s.reward(false) : 0;
+        for (size_t k = 0; k < path.size(); k++) {
+            Node& node = nodes_[path[k].first];
+            Edge& e = node.edges_[path[k].second];
+            node.visits_ += 1;
+            e.visits_ += 1;
+            e.value_ += colors[k] == BLACK ? r : -r;
+        }
+    }
+
+    int search(const state_t& root, int simulations, double seconds = -1, const atomic<bool> *stop = nullptr)
+    {
+        // stops at the number of simulations, the time limit (if positive) or the stop flag;
+        // returns the number of simulations done
+        auto start = chrono::steady_clock::now();
+        int n = 0;
+        while (n < simulations && !root.terminal()) {
+            if (stop && stop->load(memory_order_relaxed)) break;
+            if (seconds > 0 && (n & 15) == 0
+                && chrono::duration<double>(chrono::steady_clock::now() - start).count() >= seconds) break;
+            simulate(root);
+            n++;
+        }
+        return n;
+    }
+
+    vector<int> visits(const state_t& root) const
+    {
+        vector<int> v(root.action_length(), 0);
+        for (const Edge& e : nodes_[root_].edges_) v[e.action_] = e.visits_;
+        return v;
+    }
+
+    int best_action(const state_t& root) const
+    {
+        // the most visited legal action
+        vector<int> v = visits(root);
+        vector<int> actions = root.legal_actions();
+        int best = actions.empty() ? -1 : actions[0];
+        for (int action : actions) {
+            if (v[action] > v[best]) best = action;
+        }
+        return best;
+    }
+};
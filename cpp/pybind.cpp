@@ -1,3 +1,8 @@
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
 #include "util.hpp"
 #include "tictactoe.hpp"
 #include "reversi.hpp"
@@ -5,6 +10,10 @@
 #include "go.hpp"
 #include "geister.hpp"
 #include "fliptictactoe.hpp"
+#include "ismcts.hpp"
+#include "shard.hpp"
+#include "record.hpp"
+#include "replay.hpp"
 
 using namespace std;
 
@@ -16,29 +25,1004 @@ using namespace std;
 
 namespace py = pybind11;
 
+template <class T>
+py::array_t<T> output_array(py::object out, const std::vector<ssize_t>& shape)
+{
+    // a new array, or the given one when it can be filled in place
+    ssize_t size = 1;
+    for (ssize_t s : shape) size *= s;
+    if (out.is_none()) return py::array_t<T>(shape);
+    if (!py::isinstance<py::array_t<T, py::array::c_style>>(out)) {
+        throw py::value_error("out must be a C-contiguous array of the matching dtype");
+    }
+    auto a = out.cast<py::array_t<T>>();
+    if (a.size() != size || !a.writeable()) {
+        throw py::value_error("out must be a writable array of " + std::to_string(size) + " elements");
+    }
+    return a;
+}
+
+// chance outcomes given to replays: the cells swapped after each action (FlipTicTacToe)
+
+template <class state_t>
+bool needs_flips(const state_t&)
+{
+    return false;
+}
+
+inline bool needs_flips(const FlipTicTacToe::State&)
+{
+    return true;
+}
+
+template <class state_t>
+void flip_after_action(state_t&, int, int)
+{
+    throw py::value_error("no chance events in this game");
+}
+
+inline void flip_after_action(FlipTicTacToe::State& s, int pos0, int pos1)
+{
+    const int b = TicTacToe::B;
+    if (pos0 < 0 || pos0 >= b || pos1 < 0 || pos1 >= b || pos0 == pos1) {
+        throw py::value_error("invalid flip " + std::to_string(pos0) + " " + std::to_string(pos1));
+    }
+    s.flip(pos0, pos1);
+}
+
 template <class state_t>
 struct PythonState : state_t
 {
-    py::array_t<float> feature() const
+    PythonState() {}
+    PythonState(const state_t& s): state_t(s) {}
+
+    py::array_t<float> feature(py::object out) const
     {
         std::array<int, 2> size = state_t::size();
-        std::vector<float> f = state_t::feature();
-        int channels = f.size() / (size[0] * size[1]);
-        py::array_t<float> pf({channels, size[0], size[1]});
-        std::memcpy(pf.mutable_data(), f.data(), sizeof(float) * f.size());
-        return pf;
+        auto f = output_array<float>(out, {state_t::feature_channels(), size[0], size[1]});
+        state_t::feature_into(f.mutable_data());
+        return f;
+    }
+
+    py::array_t<bool> legal_action_mask() const
+    {
+        py::array_t<bool> mask(state_t::action_length());
+        bool *m = mask.mutable_data();
+        std::fill(m, m + mask.size(), false);
+        for (int action : state_t::legal_actions()) m[action] = true;
+        return mask;
+    }
+
+    py::array_t<int32_t> legal_actions_array() const
+    {
+        std::vector<int> actions = state_t::legal_actions();
+        py::array_t<int32_t> a(actions.size());
+        std::copy(actions.begin(), actions.end(), a.mutable_data());
+        return a;
     }
 
     PythonState<state_t> copy() const
     {
         return PythonState<state_t>(*this);
     }
+
+    bool playable(int action) const
+    {
+        return action >= 0 && action < state_t::action_length()
+            && !state_t::terminal() && state_t::legal(action);
+    }
+
+    std::vector<int32_t> flip_array(py::object flips, ssize_t length) const
+    {
+        // flips (k <= length, 2) in pairs; required by games with chance events
+        if (flips.is_none()) {
+            if (needs_flips(static_cast<const state_t&>(*this))) {
+                throw py::value_error("flips (the cells swapped after each action) are required by this game");
+            }
+            return {};
+        }
+        auto a = py::array_t<int32_t, py::array::c_style | py::array::forcecast>::ensure(flips);
+        if (!a || a.ndim() != 2 || a.shape(1) != 2 || a.shape(0) > length) {
+            throw py::value_error("flips must be an int array of shape (k, 2) with k <= the number of actions");
+        }
+        return std::vector<int32_t>(a.data(), a.data() + a.size());
+    }
+
+    void play_with_flip(int action, const std::vector<int32_t>& flips, size_t i)
+    {
+        // the i-th action and the outcome following it
+        state_t::play(action);
+        if (2 * i < flips.size()) flip_after_action(static_cast<state_t&>(*this), flips[2 * i], flips[2 * i + 1]);
+    }
+
+    void play_array(py::array_t<int32_t, py::array::c_style | py::array::forcecast> actions, py::object flips)
+    {
+        // stops at the first illegal action, keeping the earlier ones played
+        const int32_t *a = actions.data();
+        std::vector<int32_t> f = flip_array(flips, actions.size());
+        for (ssize_t i = 0; i < actions.size(); i++) {
+            if (!playable(a[i])) {
+                throw py::value_error("illegal action " + std::to_string(a[i]) + " at " + std::to_string(i));
+            }
+            play_with_flip(a[i], f, i);
+        }
+    }
+
+    py::tuple replay_to_features(py::array_t<int32_t, py::array::c_style | py::array::forcecast> actions,
+                                 py::array_t<int32_t, py::array::c_style | py::array::forcecast> plies,
+                                 py::object flips) const
+    {
+        // features, legal masks, played actions (-1 after the last) and final rewards
+        // from the side to move at the selected plies, replayed from this state
+        int length = actions.size(), n = plies.size();
+        std::vector<int32_t> f = flip_array(flips, length);
+        const int32_t *pa = actions.data(), *pp = plies.data();
+        std::vector<std::pair<int, int>> order(n);
+        for (int j = 0; j < n; j++) {
+            if (pp[j] < 0 || pp[j] > length) throw py::index_error("ply out of range");
+            order[j] = std::make_pair(int(pp[j]), j);
+        }
+        std::sort(order.begin(), order.end());
+
+        std::array<int, 2> size = state_t::size();
+        int channels = state_t::feature_channels(), b = size[0] * size[1];
+        int action_length = state_t::action_length();
+        py::array_t<float> features({n, channels, size[0], size[1]});
+        py::array_t<bool> masks({n, action_length});
+        py::array_t<int32_t> policies(n);
+        py::array_t<float> values(n);
+        float *pf = features.mutable_data(), *pv = values.mutable_data();
+        bool *pm = masks.mutable_data();
+        int32_t *pt = policies.mutable_data();
+        std::fill(pm, pm + masks.size(), false);
+
+        {
+            py::gil_scoped_release release;
+            PythonState<state_t> s(*this);
+            std::vector<int> colors(n);
+            size_t k = 0;
+            for (int t = 0; t <= length; t++) {
+                for (; k < order.size() && order[k].first == t; k++) {
+                    int j = order[k].second;
+                    s.feature_into(pf + size_t(j) * channels * b);
+                    for (int action : s.legal_actions()) pm[size_t(j) * action_length + action] = true;
+                    pt[j] = t < length ? pa[t] : -1;
+                    colors[j] = s.color_;
+                }
+                if (t == length) break;
+                if (!s.playable(pa[t])) {
+                    throw py::value_error("illegal action " + std::to_string(pa[t]) + " at " + std::to_string(t));
+                }
+                s.play_with_flip(pa[t], f, t);
+            }
+            float r = s.terminal() ? s.reward(false) : 0;
+            for (int j = 0; j < n; j++) pv[j] = colors[j] == BLACK ? r : -r;
+        }
+        return py::make_tuple(features, masks, policies, values);
+    }
+
+    py::bytes getstate() const
+    {
+        BinaryWriter w;
+        state_t::serialize(&w);
+        return py::bytes(w.data_);
+    }
+
+    static PythonState<state_t> setstate(const py::bytes& b)
+    {
+        // restores the full state without replaying the record
+        std::string data = b;
+        BinaryReader r(data);
+        PythonState<state_t> s;
+        if (!s.deserialize(&r) || !r.done()) throw py::value_error("invalid state encoding");
+        return s;
+    }
+
+    py::bytes record_bytes() const
+    {
+        std::string record;
+        Record::encode<state_t>(*this, &record);
+        return py::bytes(record);
+    }
+
+    static PythonState<state_t> from_record_bytes(const py::bytes& b)
+    {
+        // replays a record of record_bytes()
+        std::string data = b;
+        PythonState<state_t> s;
+        if (!Record::decode<state_t>(data, &s)) throw py::value_error("invalid game record");
+        return s;
+    }
+
+    py::bytes position_bytes() const
+    {
+        // plain memory of position(), of the same size for every position of the game
+        typename state_t::Position p = state_t::position();
+        return py::bytes((const char*)&p, sizeof(p));
+    }
+
+    static PythonState<state_t> from_position_bytes(const py::bytes& b)
+    {
+        // only for bytes of position_bytes() from the same build
+        std::string data = b;
+        if (data.size() != sizeof(typename state_t::Position)) throw py::value_error("invalid position size");
+        typename state_t::Position p;
+        memcpy(&p, data.data(), sizeof(p));
+        PythonState<state_t> s;
+        if (!s.set_position(p)) throw py::value_error("invalid position");
+        return s;
+    }
 };
 
+// operations over a sequence of states of one game
+
+template <class state_t>
+std::vector<const state_t*> cast_states(py::sequence states)
+{
+    std::vector<const state_t*> ps;
+    for (auto item : states) {
+        if (!py::isinstance<state_t>(item)) throw py::type_error("states must be of the same game");
+        ps.push_back(&item.cast<const state_t&>());
+    }
+    return ps;
+}
+
+template <class F>
+py::object for_states(py::sequence states, const F& f)
+{
+    // f(vector of state pointers) with the game of the first state
+    if (states.size() == 0) throw py::value_error("states must not be empty");
+    py::object first = states[0];
+    if (py::isinstance<PythonState<TicTacToe::State>>(first))     return f(cast_states<PythonState<TicTacToe::State>>(states));
+    if (py::isinstance<PythonState<Reversi::State>>(first))       return f(cast_states<PythonState<Reversi::State>>(states));
+    if (py::isinstance<PythonState<AnimalShogi::State>>(first))   return f(cast_states<PythonState<AnimalShogi::State>>(states));
+    if (py::isinstance<PythonState<Go::State>>(first))            return f(cast_states<PythonState<Go::State>>(states));
+    if (py::isinstance<PythonState<Geister::State>>(first))       return f(cast_states<PythonState<Geister::State>>(states));
+    if (py::isinstance<PythonState<FlipTicTacToe::State>>(first)) return f(cast_states<PythonState<FlipTicTacToe::State>>(states));
+    throw py::type_error("states must be game states");
+}
+
+struct LegalActionMasks
+{
+    template <class state_t>
+    py::object operator ()(const std::vector<const state_t*>& states) const
+    {
+        int n = states.size(), length = states[0]->action_length();
+        py::array_t<bool> masks({n, length});
+        bool *m = masks.mutable_data();
+        std::fill(m, m + masks.size(), false);
+        for (int i = 0; i < n; i++) {
+            for (int action : states[i]->legal_actions()) m[size_t(i) * length + action] = true;
+        }
+        return masks;
+    }
+};
+
+struct LegalActionsArrays
+{
+    template <class state_t>
+    py::object operator ()(const std::vector<const state_t*>& states) const
+    {
+        // padded with -1 after the legal actions of each state
+        int n = states.size();
+        std::vector<std::vector<int>> actions(n);
+        size_t width = 0;
+        for (int i = 0; i < n; i++) {
+            actions[i] = states[i]->legal_actions();
+            width = std::max(width, actions[i].size());
+        }
+        py::array_t<int32_t> a({ssize_t(n), ssize_t(width)});
+        int32_t *p = a.mutable_data();
+        std::fill(p, p + a.size(), -1);
+        for (int i = 0; i < n; i++) {
+            std::copy(actions[i].begin(), actions[i].end(), p + i * width);
+        }
+        return a;
+    }
+};
+
+struct BatchFeatures
+{
+    py::object out_;
+    int threads_;
+    bool augment_;
+    long long seed_;
+
+    template <class state_t>
+    py::object operator ()(const std::vector<const state_t*>& states) const
+    {
+        // with augment_, each feature is transformed by a random symmetry
+        // and the symmetry indices are returned together
+        int n = states.size(), channels = states[0]->feature_channels();
+        std::array<int, 2> size = states[0]->size();
+        int b = size[0] * size[1];
+        auto features = output_array<float>(out_, {n, channels, size[0], size[1]});
+        py::array_t<int32_t> syms(n);
+        float *pf = features.mutable_data();
+        int32_t *ps = syms.mutable_data();
+        std::fill(ps, ps + n, 0);
+
+        const SymmetryTables& tables = symmetry_tables<state_t>();
+        if (augment_) {
+            mt19937_64 mt(seed_ == -1 ? random_device()() : seed_);
+            for (int i = 0; i < n; i++) ps[i] = mt() % tables.count_;
+        }
+
+        {
+            py::gil_scoped_release release;
+            size_t chunk = std::max(1, n / (std::max(threads_, 1) * 4));
+            parallel_for(n, threads_, [&](size_t begin, size_t end, int) {
+                std::vector<float> tmp(channels * b);
+                for (size_t i = begin; i < end; i++) {
+                    float *f = pf + i * channels * b;
+                    if (ps[i] == 0) {
+                        states[i]->feature_into(f);
+                    } else {
+                        states[i]->feature_into(tmp.data());
+                        tables.transform_feature(ps[i], tmp.data(), f, channels);
+                    }
+                }
+            }, chunk);
+        }
+        if (augment_) return py::make_tuple(features, syms);
+        return features;
+    }
+};
+
+// symmetries of a game applied to batches of features and policies
+
+template <class F>
+py::object for_game(const std::string& game, const F& f)
+{
+    // f(a state of the game)
+    if (game == "TicTacToe")     return f(TicTacToe::State());
+    if (game == "Reversi")       return f(Reversi::State());
+    if (game == "AnimalShogi")   return f(AnimalShogi::State());
+    if (game == "Go")            return f(Go::State());
+    if (game == "Geister")       return f(Geister::State());
+    if (game == "FlipTicTacToe") return f(FlipTicTacToe::State());
+    throw py::value_error("unknown game " + game);
+}
+
+struct SymmetryTablesOf
+{
+    template <class state_t>
+    py::object operator ()(const state_t&) const
+    {
+        // (positions, actions), where index i of a position moves to table[sym][i]
+        const SymmetryTables& tables = symmetry_tables<state_t>();
+        py::array_t<int32_t> positions({tables.count_, tables.squares_});
+        py::array_t<int32_t> actions({tables.count_, tables.action_length_});
+        std::copy(tables.positions_.begin(), tables.positions_.end(), positions.mutable_data());
+        std::copy(tables.actions_.begin(), tables.actions_.end(), actions.mutable_data());
+        return py::make_tuple(positions, actions);
+    }
+};
+
+struct TransformBatch
+{
+    py::array_t<float, py::array::c_style | py::array::forcecast> in_;
+    py::array_t<int32_t, py::array::c_style | py::array::forcecast> syms_;
+    bool policy_, inverse_;
+    py::object out_;
+    int threads_;
+
+    template <class state_t>
+    py::object operator ()(const state_t& s) const
+    {
+        // features (N x channels x size) or policies (N x action_length) under a symmetry per row
+        const SymmetryTables& tables = symmetry_tables<state_t>();
+        std::vector<ssize_t> shape(in_.shape(), in_.shape() + in_.ndim());
+        int channels = s.feature_channels(), row = policy_ ? tables.action_length_ : channels * tables.squares_;
+        bool valid = policy_ ? in_.ndim() == 2 && shape[1] == row
+                             : in_.ndim() == 4 && shape[1] == channels && shape[2] * shape[3] == tables.squares_;
+        if (!valid) throw py::value_error(policy_ ? "policies must be of N x action_length" : "features must be of N x feature_shape");
+        int n = shape[0];
+        if (syms_.size() != n) throw py::value_error("one symmetry is needed per row");
+        const int32_t *ps = syms_.data();
+        for (int i = 0; i < n; i++) {
+            if (ps[i] < 0 || ps[i] >= tables.count_) throw py::value_error("symmetry out of range");
+        }
+        auto out = output_array<float>(out_, shape);
+        const float *pi = in_.data();
+        float *po = out.mutable_data();
+        if (pi == po) throw py::value_error("out must not be the input");
+        {
+            py::gil_scoped_release release;
+            parallel_for(n, threads_, [&](size_t begin, size_t end, int) {
+                for (size_t i = begin; i < end; i++) {
+                    int sym = inverse_ ? tables.inverse_[ps[i]] : ps[i];
+                    if (policy_) tables.transform_policy(sym, pi + i * row, po + i * row);
+                    else tables.transform_feature(sym, pi + i * row, po + i * row, channels);
+                }
+            }, std::max(1, n / (std::max(threads_, 1) * 4)));
+        }
+        return out;
+    }
+};
+
+// N states of a game stepped together with one call
+
+struct VecEnvBase
+{
+    virtual ~VecEnvBase() {}
+    virtual int size() const = 0;
+    virtual int action_length() const = 0;
+    virtual std::vector<ssize_t> feature_shape() const = 0;
+    virtual py::tuple reset() = 0;
+    virtual py::tuple step(py::array_t<int, py::array::c_style | py::array::forcecast> actions) = 0;
+    virtual py::object state(int index) const = 0;
+};
+
+template <class state_t>
+struct VecEnv : VecEnvBase
+{
+    std::vector<state_t> states_;
+    std::vector<mt19937_64> rngs_;
+    std::vector<uint8_t> masks_; // legal actions of the current states
+    int threads_;
+    int action_length_;
+    std::array<int, 2> board_size_;
+    int channels_;
+
+    VecEnv(int n, int threads, long long seed):
+    states_(n), threads_(threads)
+    {
+        mt19937_64 mt(seed);
+        for (int i = 0; i < n; i++) rngs_.emplace_back(mt());
+        action_length_ = states_[0].action_length();
+        board_size_ = states_[0].size();
+        channels_ = states_[0].feature_channels();
+        masks_.resize(size_t(n) * action_length_);
+        for (int i = 0; i < n; i++) {
+            restart(i);
+            for (int action : states_[i].legal_actions()) masks_[size_t(i) * action_length_ + action] = 1;
+        }
+    }
+
+    int size() const { return states_.size(); }
+    int action_length() const { return action_length_; }
+
+    std::vector<ssize_t> feature_shape() const
+    {
+        return {channels_, board_size_[0], board_size_[1]};
+    }
+
+    void restart(int i)
+    {
+        clear_state(states_[i], rngs_[i]());
+        states_[i].chance(int(rngs_[i]() >> 33));
+    }
+
+    void observe(int i, float *feature, bool *mask)
+    {
+        states_[i].feature_into(feature + size_t(i) * channels_ * board_size_[0] * board_size_[1]);
+        uint8_t *m = masks_.data() + size_t(i) * action_length_;
+        std::fill(m, m + action_length_, 0);
+        for (int action : states_[i].legal_actions()) m[action] = 1;
+        for (int a = 0; a < action_length_; a++) mask[size_t(i) * action_length_ + a] = m[a] != 0;
+    }
+
+    template <class F>
+    void run(const F& f)
+    {
+        py::gil_scoped_release release;
+        size_t n = states_.size();
+        size_t chunk = std::max(size_t(1), n / (std::max(threads_, 1) * 4));
+        parallel_for(n, threads_, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++) f(i);
+        }, chunk);
+    }
+
+    py::tuple reset()
+    {
+        int n = size();
+        py::array_t<float> features({n, channels_, board_size_[0], board_size_[1]});
+        py::array_t<bool> masks({n, action_length_});
+        float *pf = features.mutable_data();
+        bool *pm = masks.mutable_data();
+        run([&](int i) {
+            restart(i);
+            observe(i, pf, pm);
+        });
+        return py::make_tuple(features, masks);
+    }
+
+    py::tuple step(py::array_t<int, py::array::c_style | py::array::forcecast> actions)
+    {
+        // rewards are for the player who made the action; finished games restart
+        int n = size();
+        if (actions.size() != n) {
+            throw py::value_error("actions must have " + std::to_string(n) + " elements");
+        }
+        const int *pa = actions.data();
+        for (int i = 0; i < n; i++) {
+            if (pa[i] < 0 || pa[i] >= action_length_ || !masks_[size_t(i) * action_length_ + pa[i]]) {
+                throw py::value_error("illegal action " + std::to_string(pa[i]) + " in environment " + std::to_string(i));
+            }
+        }
+
+        py::array_t<float> features({n, channels_, board_size_[0], board_size_[1]});
+        py::array_t<bool> masks({n, action_length_});
+        py::array_t<float> rewards(n);
+        py::array_t<bool> dones(n);
+        float *pf = features.mutable_data(), *pr = rewards.mutable_data();
+        bool *pm = masks.mutable_data(), *pd = dones.mutable_data();
+        run([&](int i) {
+            state_t& s = states_[i];
+            int color = s.color_;
+            s.play(pa[i]);
+            if (!s.terminal()) s.chance(int(rngs_[i]() >> 33));
+            pd[i] = s.terminal();
+            pr[i] = 0;
+            if (pd[i]) {
+                float r = s.reward(false);
+                pr[i] = color == BLACK ? r : -r;
+                restart(i);
+            }
+            observe(i, pf, pm);
+        });
+        return py::make_tuple(features, masks, rewards, dones);
+    }
+
+    py::object state(int index) const
+    {
+        if (index < 0 || index >= size()) throw py::index_error("environment index out of range");
+        return py::cast(PythonState<state_t>(states_[index]));
+    }
+};
+
+VecEnvBase *make_vec_env(const std::string& game, int n, int threads, long long seed)
+{
+    if (n <= 0) throw py::value_error("the number of environments must be positive");
+    if (game == "TicTacToe")     return new VecEnv<TicTacToe::State>(n, threads, seed);
+    if (game == "Reversi")       return new VecEnv<Reversi::State>(n, threads, seed);
+    if (game == "AnimalShogi")   return new VecEnv<AnimalShogi::State>(n, threads, seed);
+    if (game == "Go")            return new VecEnv<Go::State>(n, threads, seed);
+    if (game == "Geister")       return new VecEnv<Geister::State>(n, threads, seed);
+    if (game == "FlipTicTacToe") return new VecEnv<FlipTicTacToe::State>(n, threads, seed);
+    throw py::value_error("unknown game " + game);
+}
+
+// training positions of shard files (see shard.hpp) sampled into batches
+// features are rebuilt by the game, optionally under a random symmetry,
+// and batches are prepared by background threads ahead of sample()
+
+struct ShardLoaderBase
+{
+    virtual ~ShardLoaderBase() {}
+    virtual unsigned long long size() const = 0;
+    virtual int action_length() const = 0;
+    virtual std::vector<ssize_t> feature_shape() const = 0;
+    virtual void set_priorities(py::array_t<double, py::array::c_style | py::array::forcecast> priorities) = 0;
+    virtual py::tuple get(py::array_t<long long, py::array::c_style | py::array::forcecast> indices) = 0;
+    virtual py::tuple sample() = 0;
+};
+
+template <class state_t>
+struct ShardLoader : ShardLoaderBase
+{
+    struct Batch
+    {
+        std::vector<float> features_, policies_, values_;
+        std::vector<long long> indices_;
+    };
+
+    std::vector<std::unique_ptr<Shard::Reader>> readers_;
+    std::vector<unsigned long long> firsts_; // the first index of each shard, then the total
+    std::vector<double> cumulative_; // prefix sums of priorities; empty for uniform sampling
+    std::mutex priority_mutex_;
+
+    int batch_size_, threads_, prefetch_;
+    bool augment_;
+    long long seed_;
+    int channels_, b_, action_length_;
+    std::array<int, 2> board_size_;
+    const SymmetryTables& tables_;
+    int symmetries_; // 1 without augmentation
+
+    std::deque<Batch> queue_;
+    std::mutex queue_mutex_;
+    std::condition_variable not_empty_, not_full_;
+    bool stop_;
+    std::string error_; // of a worker, raised by sample()
+    std::vector<std::thread> workers_;
+
+    ShardLoader(const std::vector<std::string>& paths, int batch_size, int threads, bool augment, long long seed, int prefetch):
+    batch_size_(batch_size), threads_(std::max(threads, 1)), prefetch_(std::max(prefetch, 1)),
+    augment_(augment), seed_(seed), tables_(symmetry_tables<state_t>()), stop_(false)
+    {
+        firsts_.push_back(0);
+        for (const std::string& path : paths) {
+            readers_.emplace_back(new Shard::Reader());
+            if (!readers_.back()->open(path)) throw py::value_error("failed to open shard " + path);
+            if (readers_.back()->game() != readers_[0]->game()) throw py::value_error("shards must be of the same game");
+            firsts_.push_back(firsts_.back() + readers_.back()->records());
+        }
+        state_t s;
+        channels_ = s.feature_channels();
+        board_size_ = s.size();
+        b_ = board_size_[0] * board_size_[1];
+        action_length_ = s.action_length();
+        symmetries_ = augment_ ? tables_.count_ : 1;
+    }
+
+    ~ShardLoader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            stop_ = true;
+        }
+        not_full_.notify_all();
+        for (auto& w : workers_) w.join();
+    }
+
+    unsigned long long size() const { return firsts_.back(); }
+    int action_length() const { return action_length_; }
+
+    std::vector<ssize_t> feature_shape() const
+    {
+        return {channels_, board_size_[0], board_size_[1]};
+    }
+
+    void set_priorities(py::array_t<double, py::array::c_style | py::array::forcecast> priorities)
+    {
+        // sampling probabilities proportional to priorities
+        if ((unsigned long long)priorities.size() != size()) {
+            throw py::value_error("priorities must have " + std::to_string(size()) + " elements");
+        }
+        const double *p = priorities.data();
+        std::vector<double> cumulative(priorities.size());
+        double sum = 0;
+        for (ssize_t i = 0; i < priorities.size(); i++) {
+            if (!(p[i] >= 0)) throw py::value_error("priorities must be non-negative");
+            cumulative[i] = sum += p[i];
+        }
+        if (sum <= 0) throw py::value_error("priorities must not be all zero");
+        std::lock_guard<std::mutex> lock(priority_mutex_);
+        cumulative_.swap(cumulative);
+    }
+
+    void draw(mt19937_64& mt, std::vector<long long> *indices)
+    {
+        std::lock_guard<std::mutex> lock(priority_mutex_);
+        for (long long& index : *indices) {
+            if (cumulative_.empty()) {
+                index = mt() % size();
+            } else {
+                double u = std::uniform_real_distribution<double>(0, cumulative_.back())(mt);
+                index = std::upper_bound(cumulative_.begin(), cumulative_.end(), u) - cumulative_.begin();
+                index = std::min(index, (long long)size() - 1);
+            }
+        }
+    }
+
+    void fill(const std::vector<long long>& indices, mt19937_64 *mt, float *features, float *policies, float *values)
+    {
+        // records are visited in the order of the files, so that each chunk is decompressed once
+        int n = indices.size();
+        std::vector<int> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return indices[a] < indices[b]; });
+
+        state_t s;
+        std::vector<int> actions;
+        std::vector<float> policy, tmp(channels_ * b_);
+        std::string raw, record;
+        int last_shard = -1;
+        size_t last_chunk = 0;
+        for (int i : order) {
+            unsigned long long index = indices[i];
+            int shard = std::upper_bound(firsts_.begin(), firsts_.end(), index) - firsts_.begin() - 1;
+            const Shard::Reader& reader = *readers_[shard];
+            unsigned long long local = index - firsts_[shard];
+            size_t chunk = reader.chunk_of(local);
+            if (shard != last_shard || chunk != last_chunk) {
+                if (!reader.read_chunk(chunk, &raw)) throw std::runtime_error("broken shard chunk");
+                last_shard = shard;
+                last_chunk = chunk;
+            }
+            float value;
+            if (!Shard::Reader::record_in_chunk(raw, reader.chunk_records(chunk), local - reader.index_[chunk].first_record_, &record)
+                || !Shard::decode_record(record, &s, &actions, &policy, &value)) {
+                throw std::runtime_error("broken shard record");
+            }
+
+            int sym = mt != nullptr && symmetries_ > 1 ? (*mt)() % symmetries_ : 0;
+            float *f = features + size_t(i) * channels_ * b_;
+            float *p = policies + size_t(i) * action_length_;
+            if (sym == 0) {
+                s.feature_into(f);
+            } else {
+                s.feature_into(tmp.data());
+                tables_.transform_feature(sym, tmp.data(), f, channels_);
+            }
+            std::fill(p, p + action_length_, 0.0f);
+            const int *perm = tables_.action(sym);
+            for (size_t k = 0; k < actions.size(); k++) p[perm[actions[k]]] = policy[k];
+            values[i] = value;
+        }
+    }
+
+    void work(int t)
+    {
+        mt19937_64 mt(seed_ * 1000003 + t);
+        while (true) {
+            Batch batch;
+            batch.indices_.resize(batch_size_);
+            batch.features_.resize(size_t(batch_size_) * channels_ * b_);
+            batch.policies_.resize(size_t(batch_size_) * action_length_);
+            batch.values_.resize(batch_size_);
+            draw(mt, &batch.indices_);
+            try {
+                fill(batch.indices_, &mt, batch.features_.data(), batch.policies_.data(), batch.values_.data());
+            } catch (const std::exception& e) {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                error_ = e.what();
+                not_empty_.notify_all();
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            not_full_.wait(lock, [&]() { return stop_ || int(queue_.size()) < prefetch_; });
+            if (stop_) return;
+            queue_.push_back(std::move(batch));
+            not_empty_.notify_one();
+        }
+    }
+
+    py::tuple sample()
+    {
+        // (features, policies, values, indices) of a batch; workers start at the first call
+        if (size() == 0) throw py::value_error("no records to sample");
+        Batch batch;
+        std::string error;
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            if (workers_.empty()) {
+                for (int t = 0; t < threads_; t++) workers_.emplace_back(&ShardLoader::work, this, t);
+            }
+            not_empty_.wait(lock, [&]() { return !queue_.empty() || !error_.empty(); });
+            if (queue_.empty()) {
+                error = error_;
+            } else {
+                batch = std::move(queue_.front());
+                queue_.pop_front();
+                not_full_.notify_one();
+            }
+        }
+        if (!error.empty()) throw std::runtime_error(error);
+        int n = batch_size_;
+        py::array_t<float> features({n, channels_, board_size_[0], board_size_[1]});
+        py::array_t<float> policies({n, action_length_});
+        py::array_t<float> values(n);
+        py::array_t<long long> indices(n);
+        std::copy(batch.features_.begin(), batch.features_.end(), features.mutable_data());
+        std::copy(batch.policies_.begin(), batch.policies_.end(), policies.mutable_data());
+        std::copy(batch.values_.begin(), batch.values_.end(), values.mutable_data());
+        std::copy(batch.indices_.begin(), batch.indices_.end(), indices.mutable_data());
+        return py::make_tuple(features, policies, values, indices);
+    }
+
+    py::tuple get(py::array_t<long long, py::array::c_style | py::array::forcecast> indices)
+    {
+        // (features, policies, values) of the given records without augmentation
+        int n = indices.size();
+        std::vector<long long> is(indices.data(), indices.data() + n);
+        for (long long i : is) {
+            if (i < 0 || (unsigned long long)i >= size()) throw py::index_error("record index out of range");
+        }
+        py::array_t<float> features({n, channels_, board_size_[0], board_size_[1]});
+        py::array_t<float> policies({n, action_length_});
+        py::array_t<float> values(n);
+        float *pf = features.mutable_data(), *pp = policies.mutable_data(), *pv = values.mutable_data();
+        {
+            py::gil_scoped_release release;
+            fill(is, nullptr, pf, pp, pv);
+        }
+        return py::make_tuple(features, policies, values);
+    }
+};
+
+ShardLoaderBase *make_shard_loader(const std::vector<std::string>& paths, int batch_size, int threads,
+                                   bool augment, long long seed, int prefetch)
+{
+    if (paths.empty()) throw py::value_error("no shard files");
+    if (batch_size <= 0) throw py::value_error("batch_size must be positive");
+    Shard::Reader reader;
+    if (!reader.open(paths[0])) throw py::value_error("failed to open shard " + paths[0]);
+    std::string game = reader.game();
+    if (seed == -1) seed = random_device()();
+    if (game == "TicTacToe")     return new ShardLoader<TicTacToe::State>(paths, batch_size, threads, augment, seed, prefetch);
+    if (game == "Reversi")       return new ShardLoader<Reversi::State>(paths, batch_size, threads, augment, seed, prefetch);
+    if (game == "AnimalShogi")   return new ShardLoader<AnimalShogi::State>(paths, batch_size, threads, augment, seed, prefetch);
+    if (game == "Go")            return new ShardLoader<Go::State>(paths, batch_size, threads, augment, seed, prefetch);
+    if (game == "Geister")       return new ShardLoader<Geister::State>(paths, batch_size, threads, augment, seed, prefetch);
+    if (game == "FlipTicTacToe") return new ShardLoader<FlipTicTacToe::State>(paths, batch_size, threads, augment, seed, prefetch);
+    throw py::value_error("unknown game " + game);
+}
+
+// positions shared between processes in a replay buffer (see replay.hpp)
+// actors add positions with search targets, learners sample them by priority
+
+struct ReplayBufferBase
+{
+    virtual ~ReplayBufferBase() {}
+    virtual uint64_t size() const = 0;
+    virtual uint64_t capacity() const = 0;
+    virtual int action_length() const = 0;
+    virtual std::vector<ssize_t> feature_shape() const = 0;
+    virtual long long add(py::object state, py::array_t<float, py::array::c_style | py::array::forcecast> policy,
+                          float value, double priority) = 0;
+    virtual py::tuple sample(int batch_size) = 0;
+    virtual void update_priorities(py::array_t<long long, py::array::c_style | py::array::forcecast> indices,
+                                   py::array_t<double, py::array::c_style | py::array::forcecast> priorities) = 0;
+    virtual bool unlink() = 0;
+};
+
+template <class state_t>
+struct ReplayBuffer : ReplayBufferBase
+{
+    Replay::Buffer buffer_;
+    mt19937_64 mt_;
+    std::string game_;
+    int channels_, b_, action_length_;
+    std::array<int, 2> board_size_;
+
+    ReplayBuffer(const std::string& name, const std::string& game, uint64_t capacity, bool create,
+                 int max_state_bytes, long long seed):
+    mt_(seed), game_(game)
+    {
+        state_t s;
+        channels_ = s.feature_channels();
+        board_size_ = s.size();
+        b_ = board_size_[0] * board_size_[1];
+        action_length_ = s.action_length();
+        bool ok = create ? buffer_.create(name, game_, capacity, action_length_, max_state_bytes)
+                         : buffer_.open(name);
+        if (!ok) throw py::value_error("failed to " + std::string(create ? "create" : "open") + " replay buffer " + name);
+        if (buffer_.game() != game_ || buffer_.action_length() != action_length_) {
+            throw py::value_error("replay buffer " + name + " is of another game");
+        }
+    }
+
+    uint64_t size() const { return buffer_.size(); }
+    uint64_t capacity() const { return buffer_.capacity(); }
+    int action_length() const { return action_length_; }
+
+    std::vector<ssize_t> feature_shape() const
+    {
+        return {channels_, board_size_[0], board_size_[1]};
+    }
+
+    long long add(py::object state, py::array_t<float, py::array::c_style | py::array::forcecast> policy,
+                  float value, double priority)
+    {
+        // the slot index; positions of the same key are merged into one slot
+        if (!py::isinstance<PythonState<state_t>>(state)) throw py::type_error("state must be of " + game_);
+        if (policy.size() != action_length_) {
+            throw py::value_error("policy must have " + std::to_string(action_length_) + " elements");
+        }
+        const state_t& s = state.cast<const PythonState<state_t>&>();
+        BinaryWriter w;
+        s.serialize(&w);
+        if (w.data_.size() > (size_t)buffer_.max_state_bytes()) throw py::value_error("state is larger than max_state_bytes");
+        long long i = buffer_.add(s.key(), w.data_, policy.data(), value, priority);
+        if (i < 0) throw std::runtime_error("replay buffer slots are held by other writers");
+        return i;
+    }
+
+    py::tuple sample(int batch_size)
+    {
+        // (features, policies, values, indices, probabilities) of positions drawn by priority
+        if (batch_size <= 0) throw py::value_error("batch_size must be positive");
+        int n = batch_size;
+        py::array_t<float> features({n, channels_, board_size_[0], board_size_[1]});
+        py::array_t<float> policies({n, action_length_});
+        py::array_t<float> values(n);
+        py::array_t<long long> indices(n);
+        py::array_t<double> probabilities(n);
+        float *pf = features.mutable_data(), *pp = policies.mutable_data(), *pv = values.mutable_data();
+        long long *pi = indices.mutable_data();
+        double *pr = probabilities.mutable_data();
+        bool empty = false;
+        {
+            py::gil_scoped_release release;
+            std::uniform_real_distribution<double> dist(0, 1);
+            std::string data;
+            state_t s;
+            for (int k = 0; k < n && !empty; k++) {
+                // slots being written or left empty by rounding are drawn again
+                for (int retry = 0; ; retry++) {
+                    if (retry >= 1000) {
+                        empty = true;
+                        break;
+                    }
+                    long long i = buffer_.sample(dist(mt_));
+                    if (i < 0 || !buffer_.read(i, &data, pp + size_t(k) * action_length_, pv + k)) continue;
+                    BinaryReader r(data);
+                    if (!s.deserialize(&r)) continue;
+                    s.feature_into(pf + size_t(k) * channels_ * b_);
+                    pi[k] = i;
+                    pr[k] = buffer_.priority(i) / buffer_.total_priority();
+                    break;
+                }
+            }
+        }
+        if (empty) throw py::value_error("replay buffer is empty");
+        return py::make_tuple(features, policies, values, indices, probabilities);
+    }
+
+    void update_priorities(py::array_t<long long, py::array::c_style | py::array::forcecast> indices,
+                           py::array_t<double, py::array::c_style | py::array::forcecast> priorities)
+    {
+        if (indices.size() != priorities.size()) throw py::value_error("indices and priorities must have the same length");
+        const long long *pi = indices.data();
+        const double *pr = priorities.data();
+        for (ssize_t k = 0; k < indices.size(); k++) {
+            if (pi[k] < 0 || (uint64_t)pi[k] >= capacity()) throw py::index_error("slot index out of range");
+            if (!(pr[k] >= 0)) throw py::value_error("priorities must be non-negative");
+        }
+        for (ssize_t k = 0; k < indices.size(); k++) buffer_.set_priority(pi[k], pr[k]);
+    }
+
+    bool unlink() { return buffer_.unlink(); }
+};
+
+ReplayBufferBase *make_replay_buffer(const std::string& name, const std::string& game, uint64_t capacity,
+                                     bool create, int max_state_bytes, long long seed)
+{
+    // without create, the game is read from the buffer
+    std::string g = game;
+    if (!create) {
+        Replay::Buffer buffer;
+        if (!buffer.open(name)) throw py::value_error("failed to open replay buffer " + name);
+        g = buffer.game();
+    }
+    if (seed == -1) seed = random_device()();
+    if (g == "TicTacToe")     return new ReplayBuffer<TicTacToe::State>(name, g, capacity, create, max_state_bytes, seed);
+    if (g == "Reversi")       return new ReplayBuffer<Reversi::State>(name, g, capacity, create, max_state_bytes, seed);
+    if (g == "AnimalShogi")   return new ReplayBuffer<AnimalShogi::State>(name, g, capacity, create, max_state_bytes, seed);
+    if (g == "Go")            return new ReplayBuffer<Go::State>(name, g, capacity, create, max_state_bytes, seed);
+    if (g == "Geister")       return new ReplayBuffer<Geister::State>(name, g, capacity, create, max_state_bytes, seed);
+    if (g == "FlipTicTacToe") return new ReplayBuffer<FlipTicTacToe::State>(name, g, capacity, create, max_state_bytes, seed);
+    throw py::value_error("unknown game " + g);
+}
+
 PYBIND11_MODULE(games, m)
 {
     m.doc() = "implementation of game";
 
+    m.def("batch_features", [](py::sequence states, py::object out, int threads, bool augment, long long seed) {
+        return for_states(states, BatchFeatures{out, threads, augment, seed});
+    }, "input features of states of a game as one array (states x channels x size), optionally written into out",
+       py::arg("states"), py::arg("out") = py::none(), py::arg("threads") = 1,
+       py::arg("augment") = false, py::arg("seed") = -1);
+    m.def("legal_action_masks", [](py::sequence states) {
+        return for_states(states, LegalActionMasks());
+    }, "legal action masks of states of a game as a bool array (states x action_length)");
+    m.def("legal_actions_arrays", [](py::sequence states) {
+        return for_states(states, LegalActionsArrays());
+    }, "legal actions of states of a game as an int32 array padded with -1");
+    m.def("symmetry_tables", [](const std::string& game) {
+        return for_game(game, SymmetryTablesOf());
+    }, "permutations of squares and actions of a game (symmetries x squares, symmetries x action_length)");
+    m.def("transform_features", [](const std::string& game, py::array_t<float, py::array::c_style | py::array::forcecast> features,
+                                   py::array_t<int32_t, py::array::c_style | py::array::forcecast> syms,
+                                   bool inverse, py::object out, int threads) {
+        return for_game(game, TransformBatch{features, syms, false, inverse, out, threads});
+    }, "features (states x channels x size) each transformed by a symmetry, or by its inverse",
+       py::arg("game"), py::arg("features"), py::arg("syms"), py::arg("inverse") = false,
+       py::arg("out") = py::none(), py::arg("threads") = 1);
+    m.def("transform_policies", [](const std::string& game, py::array_t<float, py::array::c_style | py::array::forcecast> policies,
+                                   py::array_t<int32_t, py::array::c_style | py::array::forcecast> syms,
+                                   bool inverse, py::object out, int threads) {
+        return for_game(game, TransformBatch{policies, syms, true, inverse, out, threads});
+    }, "policies (states x action_length) each transformed by a symmetry, or by its inverse to map outputs back",
+       py::arg("game"), py::arg("policies"), py::arg("syms"), py::arg("inverse") = false,
+       py::arg("out") = py::none(), py::arg("threads") = 1);
+
     TicTacToe::init();
     using PyState0 = PythonState<TicTacToe::State>;
 
@@ -50,16 +1034,32 @@ PYBIND11_MODULE(games, m)
     .def("record_string", &PyState0::record_string, "string output of current path")
     .def("__str__",       &PyState0::to_string, "string output")
     .def("copy",          &PyState0::copy, "deep copy")
+    .def("__copy__",      &PyState0::copy, "deep copy")
+    .def("__deepcopy__",  [](const PyState0& s, py::dict) { return s.copy(); }, "deep copy")
+    .def(py::pickle(&PyState0::getstate, &PyState0::setstate))
+    .def("record_bytes",  &PyState0::record_bytes, "compact binary record of the game")
+    .def_static("from_record_bytes", &PyState0::from_record_bytes, "state replayed from record_bytes()")
+    .def("position_bytes", &PyState0::position_bytes, "fixed-size plain memory of the position without the record")
+    .def_static("from_position_bytes", &PyState0::from_position_bytes, "state set from position_bytes(), whose record starts there")
     .def("clear",         &PyState0::clear, "initialize state")
     .def("legal_actions", &PyState0::legal_actions, "legal actions")
+    .def("legal_action_mask", &PyState0::legal_action_mask, "legal actions as a bool array of action_length()")
+    .def("legal_actions_array", &PyState0::legal_actions_array, "legal actions as an int32 array")
     .def("best_actions",  &PyState0::best_actions, "best actions by minimax search")
     .def("action_length", &PyState0::action_length, "the number of legal action labels")
     .def("chance",        &PyState0::chance, "state transition by chance", py::arg("seed") = -1)
     .def("play",          &PyState0::play, "state transition by action")
     .def("plays",         &PyState0::plays, "sequential state transition")
+    .def("play_array",    &PyState0::play_array, "sequential state transition by an int32 array",
+         py::arg("actions"), py::arg("flips") = py::none())
+    .def("replay_to_features", &PyState0::replay_to_features,
+         "features, legal masks, actions and final rewards at the selected plies of a replay",
+         py::arg("actions"), py::arg("plies"), py::arg("flips") = py::none())
     .def("terminal",      &PyState0::terminal, "whether terminal TicTacToe or not")
+    .def("canonical_hash", &PyState0::canonical_hash, "hash shared by symmetric positions and the symmetry to the canonical one")
     .def("reward",        &PyState0::reward, "terminal reward", py::arg("subjective") = false)
-    .def("feature",       &PyState0::feature, "input feature");
+    .def("feature",       &PyState0::feature, "input feature, optionally written into out",
+         py::arg("out") = py::none());
 
     Reversi::init();
     using PyState1 = PythonState<Reversi::State>;
@@ -72,17 +1072,35 @@ PYBIND11_MODULE(games, m)
     .def("record_string", &PyState1::record_string, "string output of current path")
     .def("__str__",       &PyState1::to_string, "string output")
     .def("copy",          &PyState1::copy, "deep copy")
+    .def("__copy__",      &PyState1::copy, "deep copy")
+    .def("__deepcopy__",  [](const PyState1& s, py::dict) { return s.copy(); }, "deep copy")
+    .def(py::pickle(&PyState1::getstate, &PyState1::setstate))
+    .def("record_bytes",  &PyState1::record_bytes, "compact binary record of the game")
+    .def_static("from_record_bytes", &PyState1::from_record_bytes, "state replayed from record_bytes()")
+    .def("position_bytes", &PyState1::position_bytes, "fixed-size plain memory of the position without the record")
+    .def_static("from_position_bytes", &PyState1::from_position_bytes, "state set from position_bytes(), whose record starts there")
     .def("clear",         &PyState1::clear, "initialize state")
     .def("legal_actions", &PyState1::legal_actions, "legal actions")
+    .def("legal_action_mask", &PyState1::legal_action_mask, "legal actions as a bool array of action_length()")
+    .def("legal_actions_array", &PyState1::legal_actions_array, "legal actions as an int32 array")
     .def("action_length", &PyState1::action_length, "the number of legal action labels")
     .def("chance",        &PyState1::chance, "state transition by chance", py::arg("seed") = -1)
     .def("play",          &PyState1::play, "state transition by action")
     .def("plays",         &PyState1::plays, "sequential state transition")
+    .def("play_array",    &PyState1::play_array, "sequential state transition by an int32 array",
+         py::arg("actions"), py::arg("flips") = py::none())
+    .def("replay_to_features", &PyState1::replay_to_features,
+         "features, legal masks, actions and final rewards at the selected plies of a replay",
+         py::arg("actions"), py::arg("plies"), py::arg("flips") = py::none())
     .def("terminal",      &PyState1::terminal, "whether terminal state or not")
+    .def("canonical_hash", &PyState1::canonical_hash, "hash shared by symmetric positions and the symmetry to the canonical one")
     .def("reward",        &PyState1::reward, "terminal reward", py::arg("subjective") = false)
-    .def("feature",       &PyState1::feature, "input feature");
+    .def("feature",       &PyState1::feature, "input feature, optionally written into out",
+         py::arg("out") = py::none());
 
     AnimalShogi::init();
+    m.def("open_animalshogi_tablebase", &AnimalShogi::open_tablebase, "map AnimalShogi tablebase file",
+          py::arg("path") = "./animalshogi.tb");
     using PyState2 = PythonState<AnimalShogi::State>;
 
     py::class_<PyState2>(m, "AnimalShogi")
@@ -93,15 +1111,35 @@ PYBIND11_MODULE(games, m)
     .def("record_string", &PyState2::record_string, "string output of current path")
     .def("__str__",       &PyState2::to_string, "string output")
     .def("copy",          &PyState2::copy, "deep copy")
+    .def("__copy__",      &PyState2::copy, "deep copy")
+    .def("__deepcopy__",  [](const PyState2& s, py::dict) { return s.copy(); }, "deep copy")
+    .def(py::pickle(&PyState2::getstate, &PyState2::setstate))
+    .def("record_bytes",  &PyState2::record_bytes, "compact binary record of the game")
+    .def_static("from_record_bytes", &PyState2::from_record_bytes, "state replayed from record_bytes()")
+    .def("position_bytes", &PyState2::position_bytes, "fixed-size plain memory of the position without the record")
+    .def_static("from_position_bytes", &PyState2::from_position_bytes, "state set from position_bytes(), whose record starts there")
     .def("clear",         &PyState2::clear, "initialize state")
     .def("legal_actions", &PyState2::legal_actions, "legal actions")
+    .def("legal_action_mask", &PyState2::legal_action_mask, "legal actions as a bool array of action_length()")
+    .def("legal_actions_array", &PyState2::legal_actions_array, "legal actions as an int32 array")
+    .def("best_actions",  &PyState2::best_actions, "best actions by tablebase, or by depth-limited alpha-beta search without one")
+    .def("tablebase_value", &PyState2::tablebase_value, "game value and distance to the end by tablebase")
+    .def("mate_search",   &PyState2::mate_search, "proof-number search for a forced win",
+         py::arg("max_nodes") = 100000)
     .def("action_length", &PyState2::action_length, "the number of legal action labels")
     .def("chance",        &PyState2::chance, "state transition by chance", py::arg("seed") = -1)
     .def("play",          &PyState2::play, "state transition by action")
     .def("plays",         &PyState2::plays, "sequential state transition")
+    .def("play_array",    &PyState2::play_array, "sequential state transition by an int32 array",
+         py::arg("actions"), py::arg("flips") = py::none())
+    .def("replay_to_features", &PyState2::replay_to_features,
+         "features, legal masks, actions and final rewards at the selected plies of a replay",
+         py::arg("actions"), py::arg("plies"), py::arg("flips") = py::none())
     .def("terminal",      &PyState2::terminal, "whether terminal state or not")
+    .def("canonical_hash", &PyState2::canonical_hash, "hash shared by symmetric positions and the symmetry to the canonical one")
     .def("reward",        &PyState2::reward, "terminal reward", py::arg("subjective") = false)
-    .def("feature",       &PyState2::feature, "input feature");
+    .def("feature",       &PyState2::feature, "input feature, optionally written into out",
+         py::arg("out") = py::none());
 
     Go::init();
     using PyState3 = PythonState<Go::State>;
@@ -114,15 +1152,31 @@ PYBIND11_MODULE(games, m)
     .def("record_string", &PyState3::record_string, "string output of current path")
     .def("__str__",       &PyState3::to_string, "string output")
     .def("copy",          &PyState3::copy, "deep copy")
+    .def("__copy__",      &PyState3::copy, "deep copy")
+    .def("__deepcopy__",  [](const PyState3& s, py::dict) { return s.copy(); }, "deep copy")
+    .def(py::pickle(&PyState3::getstate, &PyState3::setstate))
+    .def("record_bytes",  &PyState3::record_bytes, "compact binary record of the game")
+    .def_static("from_record_bytes", &PyState3::from_record_bytes, "state replayed from record_bytes()")
+    .def("position_bytes", &PyState3::position_bytes, "fixed-size plain memory of the position without the record")
+    .def_static("from_position_bytes", &PyState3::from_position_bytes, "state set from position_bytes(), whose record starts there")
     .def("clear",         &PyState3::clear, "initialize state")
     .def("legal_actions", &PyState3::legal_actions, "legal actions")
+    .def("legal_action_mask", &PyState3::legal_action_mask, "legal actions as a bool array of action_length()")
+    .def("legal_actions_array", &PyState3::legal_actions_array, "legal actions as an int32 array")
     .def("action_length", &PyState3::action_length, "the number of legal action labels")
     .def("chance",        &PyState3::chance, "state transition by chance", py::arg("seed") = -1)
     .def("play",          &PyState3::play, "state transition by action")
     .def("plays",         &PyState3::plays, "sequential state transition")
+    .def("play_array",    &PyState3::play_array, "sequential state transition by an int32 array",
+         py::arg("actions"), py::arg("flips") = py::none())
+    .def("replay_to_features", &PyState3::replay_to_features,
+         "features, legal masks, actions and final rewards at the selected plies of a replay",
+         py::arg("actions"), py::arg("plies"), py::arg("flips") = py::none())
     .def("terminal",      &PyState3::terminal, "whether terminal state or not")
+    .def("canonical_hash", &PyState3::canonical_hash, "hash shared by symmetric positions and the symmetry to the canonical one")
     .def("reward",        &PyState3::reward, "terminal reward", py::arg("subjective") = false)
-    .def("feature",       &PyState3::feature, "input feature");
+    .def("feature",       &PyState3::feature, "input feature, optionally written into out",
+         py::arg("out") = py::none());
 
     Geister::init();
     using PyState4 = PythonState<Geister::State>;
@@ -135,15 +1189,67 @@ PYBIND11_MODULE(games, m)
     .def("record_string", &PyState4::record_string, "string output of current path")
     .def("__str__",       &PyState4::to_string, "string output")
     .def("copy",          &PyState4::copy, "deep copy")
+    .def("__copy__",      &PyState4::copy, "deep copy")
+    .def("__deepcopy__",  [](const PyState4& s, py::dict) { return s.copy(); }, "deep copy")
+    .def(py::pickle(&PyState4::getstate, &PyState4::setstate))
+    .def("record_bytes",  &PyState4::record_bytes, "compact binary record of the game")
+    .def_static("from_record_bytes", &PyState4::from_record_bytes, "state replayed from record_bytes()")
+    .def("position_bytes", &PyState4::position_bytes, "fixed-size plain memory of the position without the record")
+    .def_static("from_position_bytes", &PyState4::from_position_bytes, "state set from position_bytes(), whose record starts there")
     .def("clear",         &PyState4::clear, "initialize state")
     .def("legal_actions", &PyState4::legal_actions, "legal actions")
+    .def("legal_action_mask", &PyState4::legal_action_mask, "legal actions as a bool array of action_length()")
+    .def("legal_actions_array", &PyState4::legal_actions_array, "legal actions as an int32 array")
     .def("action_length", &PyState4::action_length, "the number of legal action labels")
     .def("chance",        &PyState4::chance, "state transition by chance", py::arg("seed") = -1)
     .def("play",          &PyState4::play, "state transition by action")
     .def("plays",         &PyState4::plays, "sequential state transition")
+    .def("play_array",    &PyState4::play_array, "sequential state transition by an int32 array",
+         py::arg("actions"), py::arg("flips") = py::none())
+    .def("replay_to_features", &PyState4::replay_to_features,
+         "features, legal masks, actions and final rewards at the selected plies of a replay",
+         py::arg("actions"), py::arg("plies"), py::arg("flips") = py::none())
     .def("terminal",      &PyState4::terminal, "whether terminal state or not")
+    .def("canonical_hash", &PyState4::canonical_hash, "hash shared by symmetric positions and the symmetry to the canonical one")
     .def("reward",        &PyState4::reward, "terminal reward", py::arg("subjective") = false)
-    .def("feature",       &PyState4::feature, "input feature");
+    .def("feature",       &PyState4::feature, "input feature, optionally written into out",
+         py::arg("out") = py::none())
+    .def("determinizations", [](const PyState4& s, int player, int n, long long seed) {
+        // hidden color assignments of the opponent pieces (bit i = piece i is blue)
+        if (player != BLACK && player != WHITE) throw py::value_error("player must be 0 or 1");
+        if (n < 0) throw py::value_error("n must be non-negative");
+        if (seed == -1) seed = random_device()();
+        mt19937_64 mt(seed);
+        Geister::Determinizer d(s, player);
+        py::array_t<uint8_t> masks(n);
+        {
+            py::gil_scoped_release release;
+            d.sample(mt, n, masks.mutable_data());
+        }
+        return masks;
+    }, "sample opponent color assignments consistent with public information",
+       py::arg("player"), py::arg("n"), py::arg("seed") = -1)
+    .def("apply_determinization", [](PyState4& s, int player, int mask) {
+        if (player != BLACK && player != WHITE) throw py::value_error("player must be 0 or 1");
+        Geister::Determinizer d(s, player);
+        if (!d.consistent(mask)) {
+            throw py::value_error("mask must mark as many opponent pieces on the board as its blue pieces left");
+        }
+        d.apply(&s, mask);
+    }, "set opponent colors from an assignment in place", py::arg("player"), py::arg("mask"))
+    .def("observation", [](const PyState4& s, int player, py::object out) {
+        auto size = s.size();
+        auto f = output_array<float>(out, {s.observation_channels(), size[0], size[1]});
+        s.observation(player, f.mutable_data());
+        return f;
+    }, "input feature visible to a player, optionally written into out",
+       py::arg("player"), py::arg("out") = py::none())
+    .def("ismcts", [](const PyState4& s, int simulations, int threads, long long seed) {
+        py::gil_scoped_release release;
+        Geister::ISMCTS search;
+        return search.search(s, simulations, threads, seed);
+    }, "visit counts of actions by information set MCTS",
+       py::arg("simulations"), py::arg("threads") = 1, py::arg("seed") = 0);
 
     FlipTicTacToe::init();
     using PyState5 = PythonState<FlipTicTacToe::State>;
@@ -156,13 +1262,68 @@ PYBIND11_MODULE(games, m)
     .def("record_string", &PyState5::record_string, "string output of current path")
     .def("__str__",       &PyState5::to_string, "string output")
     .def("copy",          &PyState5::copy, "deep copy")
+    .def("__copy__",      &PyState5::copy, "deep copy")
+    .def("__deepcopy__",  [](const PyState5& s, py::dict) { return s.copy(); }, "deep copy")
+    .def(py::pickle(&PyState5::getstate, &PyState5::setstate))
+    .def("record_bytes",  &PyState5::record_bytes, "compact binary record of the game")
+    .def_static("from_record_bytes", &PyState5::from_record_bytes, "state replayed from record_bytes()")
+    .def("position_bytes", &PyState5::position_bytes, "fixed-size plain memory of the position without the record")
+    .def_static("from_position_bytes", &PyState5::from_position_bytes, "state set from position_bytes(), whose record starts there")
     .def("clear",         &PyState5::clear, "initialize state")
     .def("legal_actions", &PyState5::legal_actions, "legal actions")
+    .def("legal_action_mask", &PyState5::legal_action_mask, "legal actions as a bool array of action_length()")
+    .def("legal_actions_array", &PyState5::legal_actions_array, "legal actions as an int32 array")
     .def("action_length", &PyState5::action_length, "the number of legal action labels")
     .def("chance",        &PyState5::chance, "state transition by chance", py::arg("seed") = -1)
+    .def("flips",         [](const PyState5& s) {
+        std::vector<std::array<int, 2>> flips;
+        for (const auto& f : s.flip_record_) flips.push_back({{f[0], f[1]}});
+        return flips;
+    }, "cells swapped after each action so far, as given to play_array and replay_to_features")
     .def("play",          &PyState5::play, "state transition by action")
     .def("plays",         &PyState5::plays, "sequential state transition")
+    .def("play_array",    &PyState5::play_array, "sequential state transition by an int32 array",
+         py::arg("actions"), py::arg("flips") = py::none())
+    .def("replay_to_features", &PyState5::replay_to_features,
+         "features, legal masks, actions and final rewards at the selected plies of a replay",
+         py::arg("actions"), py::arg("plies"), py::arg("flips") = py::none())
     .def("terminal",      &PyState5::terminal, "whether terminal state or not")
+    .def("canonical_hash", &PyState5::canonical_hash, "hash shared by symmetric positions and the symmetry to the canonical one")
     .def("reward",        &PyState5::reward, "terminal reward", py::arg("subjective") = false)
-    .def("feature",       &PyState5::feature, "input feature");
+    .def("feature",       &PyState5::feature, "input feature, optionally written into out",
+         py::arg("out") = py::none());
+
+    py::class_<VecEnvBase>(m, "VecEnv")
+    .def(py::init(&make_vec_env), "N environments of a game",
+         py::arg("game"), py::arg("n"), py::arg("threads") = 1, py::arg("seed") = 0)
+    .def("__len__",       &VecEnvBase::size, "the number of environments")
+    .def("action_length", &VecEnvBase::action_length, "the number of legal action labels")
+    .def("feature_shape", &VecEnvBase::feature_shape, "shape of the input feature of a state")
+    .def("reset",         &VecEnvBase::reset, "restart all games, returning (features, legal masks)")
+    .def("step",          &VecEnvBase::step, "play one action per game, returning (features, legal masks, rewards, dones)")
+    .def("state",         &VecEnvBase::state, "copy of the state of an environment");
+
+    py::class_<ShardLoaderBase>(m, "ShardLoader")
+    .def(py::init(&make_shard_loader), "batches of training positions from shard files",
+         py::arg("paths"), py::arg("batch_size") = 256, py::arg("threads") = 1,
+         py::arg("augment") = true, py::arg("seed") = -1, py::arg("prefetch") = 4)
+    .def("__len__",       &ShardLoaderBase::size, "the number of records")
+    .def("action_length", &ShardLoaderBase::action_length, "the number of legal action labels")
+    .def("feature_shape", &ShardLoaderBase::feature_shape, "shape of the input feature of a state")
+    .def("set_priorities", &ShardLoaderBase::set_priorities, "sample records in proportion to priorities (one per record)")
+    .def("sample",        &ShardLoaderBase::sample, "next random batch, returning (features, policies, values, indices)")
+    .def("get",           &ShardLoaderBase::get, "records at indices, returning (features, policies, values)");
+    py::class_<ReplayBufferBase>(m, "ReplayBuffer")
+    .def(py::init(&make_replay_buffer), "replay buffer in shared memory, created or opened by name",
+         py::arg("name"), py::arg("game") = "", py::arg("capacity") = 1 << 20, py::arg("create") = false,
+         py::arg("max_state_bytes") = 1024, py::arg("seed") = -1)
+    .def("__len__",       &ReplayBufferBase::size, "the number of occupied slots")
+    .def("capacity",      &ReplayBufferBase::capacity, "the number of slots")
+    .def("action_length", &ReplayBufferBase::action_length, "the number of legal action labels")
+    .def("feature_shape", &ReplayBufferBase::feature_shape, "shape of the input feature of a state")
+    .def("add",           &ReplayBufferBase::add, "add a position with a policy over all actions, merging it with the same position, returning its slot",
+         py::arg("state"), py::arg("policy"), py::arg("value"), py::arg("priority") = -1.0)
+    .def("sample",        &ReplayBufferBase::sample, "random batch by priority, returning (features, policies, values, indices, probabilities)")
+    .def("update_priorities", &ReplayBufferBase::update_priorities, "set priorities of slots")
+    .def("unlink",        &ReplayBufferBase::unlink, "remove the name of the buffer, freeing it when every process closes it");
 };
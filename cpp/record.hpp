@@ -0,0 +1,256 @@
+#pragma once
+
+// compact game records
+// a record holds what is needed to replay a game from its start, bit-packed:
+// varint action count | setup (Geister) | actions | chance outcomes (FlipTicTacToe)
+// an action takes bit_width(action_length() - 1) bits of the game,
+// a Geister setup 8 bits per player and a FlipTicTacToe outcome 7 bits (one of 9 x 8 swaps)
+// in streams each record is preceded by its byte length as a varint
+
+#include <istream>
+#include <ostream>
+
+#include "util.hpp"
+#include "fliptictactoe.hpp"
+#include "geister.hpp"
+
+using namespace std;
+
+struct BitWriter
+{
+    string data_;
+    uint64_t acc_;
+    int bits_;
+
+    BitWriter(): acc_(0), bits_(0) {}
+
+    void write(uint32_t v, int n)
+    {
+        // lower n (<= 32) bits of v
+        acc_ |= uint64_t(v) << bits_;
+        bits_ += n;
+        while (bits_ >= 8) {
+            data_.push_back(char(acc_ & 0xff));
+            acc_ >>= 8;
+            bits_ -= 8;
+        }
+    }
+
+    void write_varint(uint64_t v)
+    {
+        while (v >= 0x80) {
+            write(uint32_t(v & 0x7f) | 0x80, 8);
+            v >>= 7;
+        }
+        write(uint32_t(v), 8);
+    }
+
+    void flush()
+    {
+        if (bits_ > 0) data_.push_back(char(acc_ & 0xff));
+        acc_ = 0;
+        bits_ = 0;
+    }
+};
+
+struct BitReader
+{
+    const unsigned char *p_, *end_;
+    uint64_t acc_;
+    int bits_;
+
+    BitReader(const char *data, size_t size):
+    p_((const unsigned char*)data), end_((const unsigned char*)data + size), acc_(0), bits_(0) {}
+
+    bool read(uint32_t *v, int n)
+    {
+        while (bits_ < n) {
+            if (p_ == end_) return false;
+            acc_ |= uint64_t(*p_++) << bits_;
+            bits_ += 8;
+        }
+        *v = uint32_t(acc_ & ((uint64_t(1) << n) - 1));
+        acc_ >>= n;
+        bits_ -= n;
+        return true;
+    }
+
+    bool read_varint(uint64_t *v)
+    {
+        *v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint32_t byte;
+            if (!read(&byte, 8)) return false;
+            *v |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+};
+
+namespace Record
+{
+    const uint64_t MAX_RECORD_BYTES = 1 << 20; // far above the record of any game here
+
+    inline int action_bits(int action_length)
+    {
+        int bits = 1;
+        while ((1 << bits) < action_length) bits++;
+        return bits;
+    }
+
+    // setups and chance outcomes of games having them
+
+    template <class state_t>
+    void encode_setup(BitWriter *w, const state_t& s) {}
+
+    inline void encode_setup(BitWriter *w, const Geister::State& s)
+    {
+        for (int setup : s.setup()) w->write(setup, 8);
+    }
+
+    template <class state_t>
+    bool decode_setup(BitReader *r, state_t *s)
+    {
+        s->clear();
+        return true;
+    }
+
+    inline bool decode_setup(BitReader *r, Geister::State *s)
+    {
+        array<int, 2> setup;
+        for (int& v : setup) {
+            uint32_t bits;
+            if (!r->read(&bits, 8) || __builtin_popcount(bits) != 4) return false;
+            v = bits;
+        }
+        s->set_setup(setup);
+        return true;
+    }
+
+    template <class state_t>
+    void encode_chances(BitWriter *w, const state_t& s) {}
+
+    inline void encode_chances(BitWriter *w, const FlipTicTacToe::State& s)
+    {
+        const int b = TicTacToe::B;
+        w->write_varint(s.flip_record_.size());
+        for (const auto& f : s.flip_record_) {
+            w->write(f[0] * (b - 1) + (f[1] > f[0] ? f[1] - 1 : f[1]), 7);
+        }
+    }
+
+    template <class state_t>
+    bool replay(BitReader *r, state_t *s, const vector<int>& actions)
+    {
+        for (int action : actions) {
+            if (s->terminal() || !s->legal(action)) return false;
+            s->play(action);
+        }
+        return true;
+    }
+
+    inline bool replay(BitReader *r, FlipTicTacToe::State *s, const vector<int>& actions)
+    {
+        // the k-th outcome follows the k-th action
+        const int b = TicTacToe::B;
+        uint64_t n;
+        if (!r->read_varint(&n) || n > actions.size()) return false;
+        for (size_t k = 0; k < actions.size(); k++) {
+            if (s->terminal() || !s->legal(actions[k])) return false;
+            s->play(actions[k]);
+            if (k < n) {
+                uint32_t outcome;
+                if (!r->read(&outcome, 7) || outcome >= uint32_t(b * (b - 1))) return false;
+                int pos0 = outcome / (b - 1), pos1 = outcome % (b - 1);
+                if (pos1 >= pos0) pos1++;
+                s->flip(pos0, pos1);
+            }
+        }
+        return true;
+    }
+
+    template <class state_t>
+    void encode(const state_t& s, string *record)
+    {
+        BitWriter w;
+        w.write_varint(s.record_.size());
+        encode_setup(&w, s);
+        int bits = action_bits(s.action_length());
+        for (int action : s.record_) w.write(action, bits);
+        encode_chances(&w, s);
+        w.flush();
+        record->swap(w.data_);
+    }
+
+    template <class state_t>
+    bool decode(const char *data, size_t size, state_t *s)
+    {
+        // replays the record into s; false for a broken record or illegal actions
+        BitReader r(data, size);
+        uint64_t n;
+        if (!r.read_varint(&n) || n > size * 8 || !decode_setup(&r, s)) return false;
+        int bits = action_bits(s->action_length());
+        vector<int> actions(n);
+        for (int& action : actions) {
+            uint32_t v;
+            if (!r.read(&v, bits)) return false;
+            action = v;
+        }
+        return replay(&r, s, actions) && r.p_ == r.end_;
+    }
+
+    template <class state_t>
+    bool decode(const string& record, state_t *s)
+    {
+        return decode(record.data(), record.size(), s);
+    }
+
+    struct StreamWriter
+    {
+        ostream& os_;
+
+        StreamWriter(ostream& os): os_(os) {}
+
+        template <class state_t>
+        bool write(const state_t& s)
+        {
+            string record;
+            encode(s, &record);
+            BitWriter w;
+            w.write_varint(record.size());
+            os_.write(w.data_.data(), w.data_.size());
+            os_.write(record.data(), record.size());
+            return bool(os_);
+        }
+    };
+
+    struct StreamReader
+    {
+        istream& is_;
+        string record_;
+
+        StreamReader(istream& is): is_(is) {}
+
+        bool next()
+        {
+            // the next record into record_; false at the end of the stream or on a broken length
+            uint64_t size = 0;
+            for (int shift = 0; ; shift += 7) {
+                int c = is_.get();
+                if (c == EOF || shift >= 64) return false;
+                size |= uint64_t(c & 0x7f) << shift;
+                if (!(c & 0x80)) break;
+            }
+            if (size > MAX_RECORD_BYTES) return false;
+            record_.resize(size);
+            return size == 0 || bool(is_.read(&record_[0], size));
+        }
+
+        template <class state_t>
+        bool read(state_t *s)
+        {
+            return next() && decode(record_, s);
+        }
+    };
+}
@@ -0,0 +1,387 @@
+#pragma once
+
+// replay buffer in POSIX shared memory
+// actors add positions and learners sample them from any number of local processes:
+// - a ring of slots, each with a sequence number that is odd while the slot is written,
+//   so that readers copy a slot and retry on a change instead of locking it; the writer's pid
+//   is kept with the sequence, so that a slot left odd by a dead process is taken over, and
+//   a slot busy for too long is skipped by writers instead of waited for
+// - an open-addressed index from position keys to slots; a position added again is merged
+//   into its slot, whose policy and value sums are averaged when read
+// - a sum tree of priorities updated by atomic additions for prioritised sampling
+// a key added by two processes at once may take two slots, and a sample may see
+// priorities being updated; neither matters for training
+// layout: Header | IndexEntry * index size | sum tree (2 * capacity) | slots
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#include "util.hpp"
+
+using namespace std;
+
+namespace Replay
+{
+    static constexpr const char *MAGIC = "GIREPL03";
+    static constexpr uint64_t RESERVED = ~uint64_t(0);
+    static constexpr int MAX_PROBES = 32;
+    static constexpr int MAX_SPINS = 1 << 12;
+
+    struct Header
+    {
+        char magic_[8];
+        char game_[24];
+        uint64_t capacity_; // a power of 2
+        uint64_t index_size_; // a power of 2
+        uint64_t slot_bytes_;
+        uint32_t action_length_;
+        uint32_t max_state_bytes_;
+        atomic<uint64_t> cursor_; // slots taken so far
+        atomic<uint64_t> additions_; // including merged ones
+        atomic<double> max_priority_;
+    };
+
+    struct IndexEntry
+    {
+        atomic<long long> key_;
+        atomic<uint64_t> slot_; // slot + 1, 0 for empty or RESERVED while being claimed
+    };
+
+    struct Slot
+    {
+        atomic<uint64_t> seq_; // sequence number in the low 32 bits, the writer's pid in the high ones
+        uint32_t state_bytes_;
+        atomic<long long> key_;
+        uint32_t count_; // 0 for an empty slot
+        float value_sum_;
+        // then policy sums (action_length floats) and the serialized state
+    };
+
+    inline bool power_of_2(uint64_t n)
+    {
+        return n > 0 && (n & (n - 1)) == 0;
+    }
+
+    inline void atomic_add(atomic<double>& a, double delta)
+    {
+        double old = a.load(memory_order_relaxed);
+        while (!a.compare_exchange_weak(old, old + delta, memory_order_relaxed)) {}
+    }
+
+    struct Buffer
+    {
+        Header *header_;
+        IndexEntry *index_;
+        atomic<double> *tree_;
+        char *slots_;
+        void *map_;
+        size_t map_size_;
+        string name_;
+
+        Buffer(): header_(nullptr), map_(nullptr), map_size_(0) {}
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        ~Buffer() { close(); }
+
+        static size_t layout_size(uint64_t capacity, uint64_t index_size, uint64_t slot_bytes)
+        {
+            return sizeof(Header) + sizeof(IndexEntry) * index_size
+                 + sizeof(atomic<double>) * 2 * capacity + slot_bytes * capacity;
+        }
+
+        bool map(int fd, size_t size)
+        {
+            void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                std::perror("failed to map replay buffer.\n");
+                return false;
+            }
+            map_ = map;
+            map_size_ = size;
+            header_ = (Header*)map_;
+            index_ = (IndexEntry*)(header_ + 1);
+            return true;
+        }
+
+        void locate()
+        {
+            tree_ = (atomic<double>*)(index_ + header_->index_size_);
+            slots_ = (char*)(tree_ + 2 * header_->capacity_);
+        }
+
+        bool create(const string& name, const string& game, uint64_t capacity,
+                    int action_length, int max_state_bytes)
+        {
+            // fails if the name exists; capacity is rounded up to a power of 2
+            close();
+            if (name.empty()) return false;
+            if (!atomic<double>().is_lock_free() || !atomic<long long>().is_lock_free()) return false;
+            uint64_t cap = 1;
+            while (cap < capacity) cap <<= 1;
+            uint64_t slot_bytes = sizeof(Slot) + sizeof(float) * action_length + max_state_bytes;
+            slot_bytes = (slot_bytes + 63) / 64 * 64;
+            size_t size = layout_size(cap, cap * 2, slot_bytes);
+
+            name_ = name[0] == '/' ? name : "/" + name;
+            int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd < 0 || ftruncate(fd, size) < 0) {
+                std::perror("failed to create replay buffer.\n");
+                if (fd >= 0) {
+                    ::close(fd);
+                    shm_unlink(name_.c_str());
+                }
+                return false;
+            }
+            if (!map(fd, size)) return false;
+
+            // the memory is zero filled, which is a valid state of every atomic
+            memcpy(header_->magic_, MAGIC, 8);
+            strncpy(header_->game_, game.c_str(), sizeof(header_->game_) - 1);
+            header_->capacity_ = cap;
+            header_->index_size_ = cap * 2;
+            header_->slot_bytes_ = slot_bytes;
+            header_->action_length_ = action_length;
+            header_->max_state_bytes_ = max_state_bytes;
+            header_->max_priority_.store(1.0);
+            locate();
+            return true;
+        }
+
+        bool open(const string& name)
+        {
+            close();
+            if (name.empty()) return false;
+            name_ = name[0] == '/' ? name : "/" + name;
+            int fd = shm_open(name_.c_str(), O_RDWR, 0600);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Header) || !map(fd, st.st_size)) {
+                if (map_ == nullptr) ::close(fd);
+                return false;
+            }
+            const Header& h = *header_;
+            if (strncmp(h.magic_, MAGIC, 8) != 0
+                || !power_of_2(h.capacity_) || !power_of_2(h.index_size_)
+                || h.capacity_ > map_size_ || h.index_size_ > map_size_ || h.slot_bytes_ > map_size_
+                || h.slot_bytes_ < sizeof(Slot) + sizeof(float) * h.action_length_ + h.max_state_bytes_
+                || layout_size(h.capacity_, h.index_size_, h.slot_bytes_) != map_size_) {
+                cerr << "invalid replay buffer " << name << endl;
+                close();
+                return false;
+            }
+            locate();
+            return true;
+        }
+
+        void close()
+        {
+            if (map_ != nullptr) munmap(map_, map_size_);
+            map_ = nullptr;
+            header_ = nullptr;
+        }
+
+        bool unlink()
+        {
+            // the memory is freed when every process has closed it
+            return !name_.empty() && shm_unlink(name_.c_str()) == 0;
+        }
+
+        bool loaded() const { return header_ != nullptr; }
+
+        string game() const { return string(header_->game_, strnlen(header_->game_, sizeof(header_->game_))); }
+        uint64_t capacity() const { return header_->capacity_; }
+        int action_length() const { return header_->action_length_; }
+        int max_state_bytes() const { return header_->max_state_bytes_; }
+
+        uint64_t size() const
+        {
+            return min(header_->cursor_.load(memory_order_relaxed), header_->capacity_);
+        }
+
+        Slot& slot(uint64_t i) const
+        {
+            return *(Slot*)(slots_ + header_->slot_bytes_ * i);
+        }
+
+        float *policy_sums(Slot& s) const { return (float*)(&s + 1); }
+        char *state_data(Slot& s) const { return (char*)(policy_sums(s) + header_->action_length_); }
+
+        bool lock(Slot& s) const
+        {
+            // writers exclude each other per slot and readers never wait; false when another
+            // process holds the slot for too long, or a dead one whose pid was reused
+            uint64_t pid = uint64_t(getpid()) << 32;
+            for (int spin = 0; spin < MAX_SPINS; spin++) {
+                uint64_t word = s.seq_.load(memory_order_relaxed);
+                uint32_t seq = uint32_t(word);
+                int owner = word >> 32;
+                bool dead = (seq & 1) && owner > 0 && kill(owner, 0) < 0 && errno == ESRCH;
+                if (!(seq & 1) || dead) {
+                    // an abandoned slot moves to the next odd sequence number
+                    uint32_t next = seq + ((seq & 1) ? 2 : 1);
+                    if (s.seq_.compare_exchange_weak(word, pid | next, memory_order_acquire)) {
+                        atomic_thread_fence(memory_order_release);
+                        return true;
+                    }
+                    continue;
+                }
+                this_thread::yield();
+            }
+            return false;
+        }
+
+        void unlock(Slot& s) const
+        {
+            uint32_t seq = uint32_t(s.seq_.load(memory_order_relaxed));
+            s.seq_.store(uint32_t(seq + 1), memory_order_release);
+        }
+
+        uint64_t index_position(long long key) const
+        {
+            return ((unsigned long long)key * 0x9E3779B97F4A7C15ULL) & (header_->index_size_ - 1);
+        }
+
+        long long find(long long key) const
+        {
+            // the slot of a key, or -1
+            uint64_t mask = header_->index_size_ - 1;
+            for (int k = 0; k < MAX_PROBES; k++) {
+                IndexEntry& e = index_[(index_position(key) + k) & mask];
+                uint64_t s = e.slot_.load(memory_order_acquire);
+                if (s == 0) return -1;
+                if (s == RESERVED || e.key_.load(memory_order_relaxed) != key) continue;
+                if (slot(s - 1).key_.load(memory_order_relaxed) == key) return s - 1;
+            }
+            return -1;
+        }
+
+        void insert(long long key, uint64_t i)
+        {
+            // takes an empty entry or one whose slot was reused for another key
+            uint64_t mask = header_->index_size_ - 1;
+            for (int k = 0; k < MAX_PROBES; k++) {
+                IndexEntry& e = index_[(index_position(key) + k) & mask];
+                uint64_t s = e.slot_.load(memory_order_acquire);
+                if (s == RESERVED) continue;
+                long long old_key = e.key_.load(memory_order_relaxed);
+                bool stale = s == 0 || (old_key != key && slot(s - 1).key_.load(memory_order_relaxed) != old_key);
+                if (!stale && old_key != key) continue;
+                if (!e.slot_.compare_exchange_strong(s, RESERVED, memory_order_acquire)) continue;
+                e.key_.store(key, memory_order_relaxed);
+                e.slot_.store(i + 1, memory_order_release);
+                return;
+            }
+        }
+
+        void set_priority(uint64_t i, double priority)
+        {
+            uint64_t node = header_->capacity_ + i;
+            double delta = priority - tree_[node].exchange(priority, memory_order_relaxed);
+            for (node /= 2; node >= 1; node /= 2) atomic_add(tree_[node], delta);
+            double m = header_->max_priority_.load(memory_order_relaxed);
+            while (priority > m && !header_->max_priority_.compare_exchange_weak(m, priority)) {}
+        }
+
+        double total_priority() const
+        {
+            return tree_[1].load(memory_order_relaxed);
+        }
+
+        long long add(long long key, const string& state, const float *policy, float value, double priority = -1)
+        {
+            // the slot taken or merged into, or -1 for a state too large or when the slots
+            // tried are all held by other writers; a negative priority means the largest priority so far
+            if (state.size() > header_->max_state_bytes_) return -1;
+            header_->additions_.fetch_add(1, memory_order_relaxed);
+            int n = header_->action_length_;
+
+            long long i = find(key);
+            if (i >= 0) {
+                Slot& s = slot(i);
+                bool same = false;
+                if (lock(s)) {
+                    same = s.key_.load(memory_order_relaxed) == key && s.count_ > 0;
+                    if (same) {
+                        s.count_ += 1;
+                        s.value_sum_ += value;
+                        float *p = policy_sums(s);
+                        for (int a = 0; a < n; a++) p[a] += policy[a];
+                    }
+                    unlock(s);
+                }
+                if (same) {
+                    if (priority >= 0) set_priority(i, priority);
+                    return i;
+                }
+            }
+
+            for (int k = 0; ; k++) {
+                if (k == MAX_PROBES) return -1;
+                i = header_->cursor_.fetch_add(1, memory_order_relaxed) & (header_->capacity_ - 1);
+                if (lock(slot(i))) break;
+            }
+            Slot& s = slot(i);
+            s.key_.store(key, memory_order_relaxed);
+            s.count_ = 1;
+            s.value_sum_ = value;
+            memcpy(policy_sums(s), policy, sizeof(float) * n);
+            s.state_bytes_ = state.size();
+            memcpy(state_data(s), state.data(), state.size());
+            unlock(s);
+            set_priority(i, priority >= 0 ? priority : header_->max_priority_.load(memory_order_relaxed));
+            insert(key, i);
+            return i;
+        }
+
+        bool read(uint64_t i, string *state, float *policy, float *value, int *count = nullptr) const
+        {
+            // averaged targets of a slot; false for an empty slot or one kept busy by writers
+            Slot& s = slot(i);
+            int n = header_->action_length_;
+            for (int retry = 0; retry < 1000; retry++) {
+                uint64_t seq = s.seq_.load(memory_order_acquire);
+                if (seq & 1) {
+                    this_thread::yield();
+                    continue;
+                }
+                uint32_t c = s.count_, bytes = min(s.state_bytes_, header_->max_state_bytes_);
+                float v = s.value_sum_;
+                memcpy(policy, policy_sums(s), sizeof(float) * n);
+                state->assign(state_data(s), bytes);
+                atomic_thread_fence(memory_order_acquire);
+                if (s.seq_.load(memory_order_relaxed) != seq) continue;
+                if (c == 0) return false;
+                for (int a = 0; a < n; a++) policy[a] /= c;
+                *value = v / c;
+                if (count) *count = c;
+                return true;
+            }
+            return false;
+        }
+
+        long long sample(double u) const
+        {
+            // the slot at u (in [0, 1)) of the cumulative priorities, or -1 when nothing is stored
+            double x = u * total_priority();
+            uint64_t node = 1, capacity = header_->capacity_;
+            if (!(total_priority() > 0)) return -1;
+            while (node < capacity) {
+                double left = tree_[2 * node].load(memory_order_relaxed);
+                if (x < left) {
+                    node = 2 * node;
+                } else {
+                    x -= left;
+                    node = 2 * node + 1;
+                }
+            }
+            return node - capacity;
+        }
+
+        double priority(uint64_t i) const
+        {
+            return tree_[header_->capacity_ + i].load(memory_order_relaxed);
+        }
+    };
+}
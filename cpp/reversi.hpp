@@ -1,7 +1,11 @@
 #pragma once
 
+#include <random>
+#include <type_traits>
+
 #include "util.hpp"
 #include "boardgame.hpp"
+#include "symmetry.hpp"
 
 using namespace std;
 
@@ -11,40 +15,62 @@ namespace Reversi
     const string Y = "12345678";
     const string C = "XO.";
 
-    inline void init() {}
+    long long STONE_KEY[8 * 8][2]; // by y * 8 + x for any board size
+
+    inline void init()
+    {
+        mt19937_64 mt(0);
+        for (int pos = 0; pos < 8 * 8; pos++) {
+            STONE_KEY[pos][0] = mt();
+            STONE_KEY[pos][1] = mt();
+        }
+    }
+
+    constexpr int MAX_B = 8 * 8;
 
     struct State
     {
+        // fixed-size members only, so that a state is copied as plain memory;
+        // a game has at most MAX_B - 4 placements, each after at most one pass
         int L_ = 6;
-        vector<int> board_;
+        array<int8_t, MAX_B> board_; // the first L_ * L_ cells
         int color_;
         array<int, 2> score_;
-        vector<array<int, 8>> flipped_counts_; // for undo
-        vector<int> record_;
+        FixedVector<array<int8_t, 8>, MAX_B> flipped_counts_; // for undo
+        FixedVector<int16_t, MAX_B * 2> record_;
+        array<long long, 8> symmetric_keys_; // Zobrist keys of the board seen through each symmetry
+
+        using Position = State;
 
         State()
         {
-            board_.resize(L_ * L_);
             clear();
         }
 
-        State(const State& s):
-        L_(s.L_),
-        board_(s.board_),
-        color_(s.color_),
-        score_(s.score_),
-        flipped_counts_(s.flipped_counts_),
-        record_(s.record_) {}
-
         array<int, 2> size() const
         {
             return {L_, L_};
         }
 
+        Position position() const
+        {
+            return *this;
+        }
+
+        bool set_position(const Position& p)
+        {
+            if (!p.valid()) return false;
+            *this = p;
+            reset_score();
+            reset_symmetric_keys();
+            return true;
+        }
+
         void clear()
         {
             fill(board_.begin(), board_.end(), EMPTY);
             color_ = BLACK;
+            flipped_counts_.clear();
             record_.clear();
 
             // original state
@@ -54,6 +80,88 @@ namespace Reversi
             board_[xy2action(mid + 1, mid)] = BLACK;
             board_[xy2action(mid + 1, mid + 1)] = WHITE;
             score_.fill(2);
+            reset_symmetric_keys();
+        }
+
+        void serialize(BinaryWriter *w) const
+        {
+            w->write(L_);
+            w->write(uint32_t(L_ * L_));
+            for (int pos = 0; pos < L_ * L_; pos++) w->write(board_[pos]);
+            w->write(color_);
+            w->write(uint32_t(flipped_counts_.size()));
+            for (const auto& counts : flipped_counts_) {
+                for (int cnt : counts) w->write(int8_t(cnt));
+            }
+            w->write_as<int16_t>(record_);
+        }
+
+        bool deserialize(BinaryReader *r)
+        {
+            uint32_t n;
+            if (!r->read(&L_) || L_ < 2 || L_ > 8 || !r->read(&n) || int(n) != L_ * L_) return false;
+            board_.fill(EMPTY);
+            for (int pos = 0; pos < L_ * L_; pos++) {
+                if (!r->read(&board_[pos])) return false;
+            }
+            if (!r->read(&color_) || !r->read(&n) || n > flipped_counts_.capacity()) return false;
+            flipped_counts_.clear();
+            for (uint32_t i = 0; i < n; i++) {
+                array<int8_t, 8> counts;
+                if (!r->read(&counts)) return false;
+                flipped_counts_.push_back(counts);
+            }
+            if (!r->read_as<int16_t>(&record_) || !valid()) return false;
+            reset_score();
+            reset_symmetric_keys();
+            return true;
+        }
+
+        void reset_score()
+        {
+            score_.fill(0);
+            for (int pos = 0; pos < L_ * L_; pos++) {
+                if (board_[pos] != EMPTY) score_[board_[pos]]++;
+            }
+        }
+
+        bool valid() const
+        {
+            // whether the stored members can describe a position reached by play()
+            if (L_ < 2 || L_ > 8 || (color_ != BLACK && color_ != WHITE)) return false;
+            if (flipped_counts_.size() > flipped_counts_.capacity() || record_.size() > record_.capacity()) return false;
+            for (int pos = 0; pos < MAX_B; pos++) {
+                if (board_[pos] != BLACK && board_[pos] != WHITE && board_[pos] != EMPTY) return false;
+                if (pos >= L_ * L_ && board_[pos] != EMPTY) return false;
+            }
+            for (const auto& counts : flipped_counts_) {
+                for (int cnt : counts) {
+                    if (cnt < 0 || cnt > L_ - 2) return false;
+                }
+            }
+            size_t placements = 0;
+            for (int action : record_) {
+                if (action < 0 || action > L_ * L_) return false;
+                if (action != L_ * L_) placements++;
+            }
+            return placements == flipped_counts_.size();
+        }
+
+        void toggle_stone_key(int pos, int color)
+        {
+            for (int sym = 0; sym < 8; sym++) {
+                int x = action2x(pos), y = action2y(pos);
+                transform_xy(sym, L_, L_, &x, &y);
+                symmetric_keys_[sym] ^= STONE_KEY[y * 8 + x][color];
+            }
+        }
+
+        void reset_symmetric_keys()
+        {
+            symmetric_keys_.fill(0);
+            for (int pos = 0; pos < L_ * L_; pos++) {
+                if (board_[pos] != EMPTY) toggle_stone_key(pos, board_[pos]);
+            }
         }
 
         string action2str(int action) const
@@ -115,6 +223,7 @@ namespace Reversi
                 auto counts = flip_counts(action);
                 int flipped = flip_stones(action, counts);
                 board_[action] = color_;
+                toggle_stone_key(action, color_);
                 score_[color_] += 1 + flipped;
                 score_[opponent(color_)] -= flipped;
                 flipped_counts_.push_back(counts);
@@ -133,6 +242,7 @@ namespace Reversi
                 auto counts = flipped_counts_.back();
                 int flipped = flip_stones(action, counts);
                 board_[action] = EMPTY;
+                toggle_stone_key(action, opponent(color_));
                 score_[opponent(color_)] -= 1 + flipped;
                 score_[color_] += flipped;
                 flipped_counts_.pop_back();
@@ -148,6 +258,22 @@ namespace Reversi
             for (const string& s : ss) play(str2action(s));
         }
 
+        long long key() const
+        {
+            // the board in base 3, exact up to 6 x 6
+            unsigned long long key = color_;
+            for (int pos = 0; pos < L_ * L_; pos++) key = key * 3 + board_[pos];
+            return key;
+        }
+
+        pair<long long, int> canonical_hash() const
+        {
+            // a key shared by symmetric positions and the symmetry to the canonical one
+            array<long long, 8> keys;
+            for (int sym = 0; sym < 8; sym++) keys[sym] = symmetric_keys_[sym] ^ color_;
+            return smallest_key(keys.data(), 8);
+        }
+
         bool terminal() const
         {
             bool full = score_[0] + score_[1] == L_ * L_;
@@ -203,14 +329,44 @@ namespace Reversi
             return L_ * L_ + 1;
         }
 
+        int symmetry_count() const
+        {
+            return 8;
+        }
+
+        int transform_position(int sym, int pos) const
+        {
+            int x = action2x(pos), y = action2y(pos);
+            transform_xy(sym, L_, L_, &x, &y);
+            return xy2action(x, y);
+        }
+
+        int transform_action(int sym, int action) const
+        {
+            if (action == L_ * L_) return action; // pass
+            return transform_position(sym, action);
+        }
+
+        int feature_channels() const
+        {
+            return 2;
+        }
+
         vector<float> feature() const
         {
-            vector<float> f(2 * L_ * L_, 0.0f);
+            vector<float> f(feature_channels() * L_ * L_);
+            feature_into(f.data());
+            return f;
+        }
+
+        void feature_into(float *f) const
+        {
+            // feature_channels() planes written into f
+            fill(f, f + 2 * L_ * L_, 0.0f);
             for (int pos = 0; pos < L_ * L_; pos++) {
                 if      (board_[pos] == color_)           f[pos] = 1;
                 else if (board_[pos] == opponent(color_)) f[pos + L_ * L_] = 1;
             }
-            return f;
         }
 
         int score(bool subjective = true) const
@@ -234,9 +390,9 @@ namespace Reversi
             return y * L_ + x;
         }
 
-        array<int, 8> flip_counts(int action) const
+        array<int8_t, 8> flip_counts(int action) const
         {
-            array<int, 8> counts;
+            array<int8_t, 8> counts;
             counts.fill(0);
             if (!onboard(action, L_)) return counts;
             if (board_[action] != EMPTY) return counts;
@@ -260,7 +416,7 @@ namespace Reversi
             return counts;
         }
 
-        int flip_stones(int action, const array<int, 8>& counts)
+        int flip_stones(int action, const array<int8_t, 8>& counts)
         {
             for (int d = 0; d < 8; d++) {
                 int x = action2x(action);
@@ -271,9 +427,13 @@ namespace Reversi
                     assert(onboard_xy(x, y, L_));
                     int pos = xy2action(x, y);
                     board_[pos] = opponent(board_[pos]);
+                    toggle_stone_key(pos, BLACK);
+                    toggle_stone_key(pos, WHITE);
                 }
             }
             return sum_of(counts);
         }
     };
+
+    static_assert(is_trivially_copyable<State>::value, "Reversi::State must be plain memory");
 }
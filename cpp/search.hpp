@@ -68,4 +68,41 @@ std::pair<std::vector<int>, float> alpha_beta_search(state_t& state)
         state.undo();
     }
     return std::make_pair(best_actions, best);
-}
\ No newline at end of file
+}
+// depth-limited alpha-beta on copies of states, for games without undo;
+// positions at the depth limit are valued 0
+
+template <class state_t>
+float alpha_beta_depth_impl(const state_t& state, int depth, float alpha, float beta)
+{
+    if (state.terminal()) return state.reward();
+    if (depth <= 0) return 0;
+    for (int action : state.legal_actions()) {
+        state_t child(state);
+        child.play(action);
+        alpha = std::max(alpha, -alpha_beta_depth_impl(child, depth - 1, -beta, -alpha));
+        if (alpha >= beta) return alpha;
+    }
+    return alpha;
+}
+
+template <class state_t>
+std::pair<std::vector<int>, float> alpha_beta_search(const state_t& state, int depth)
+{
+    float best = -10000;
+    std::vector<int> best_actions;
+    if (state.terminal()) return std::make_pair(best_actions, state.reward());
+    for (int action : state.legal_actions()) {
+        state_t child(state);
+        child.play(action);
+        float reward = -alpha_beta_depth_impl(child, depth - 1, -10000, -best + 1e-4);
+        if (reward >= best) {
+            if (reward > best) {
+                best = reward;
+                best_actions.clear();
+            }
+            best_actions.push_back(action);
+        }
+    }
+    return std::make_pair(best_actions, best);
+}
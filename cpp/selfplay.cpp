@@ -0,0 +1,242 @@
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <chrono>
+
+#include "util.hpp"
+#include "search.hpp"
+#include "mcts.hpp"
+#include "shard.hpp"
+#include "tictactoe.hpp"
+#include "reversi.hpp"
+#include "animalshogi.hpp"
+#include "go.hpp"
+#include "geister.hpp"
+#include "fliptictactoe.hpp"
+#include "ismcts.hpp"
+
+using namespace std;
+
+// self-play games written to training shards
+// usage: selfplay <game> [-g games] [-t threads] [-s search] [-o output prefix]
+//                 [-r records per shard] [-c records per chunk] [-temp plies] [-seed seed]
+// search: random, alphabeta:<depth>, mcts:<simulations>
+// each thread writes <prefix>-<thread>-<number>.shard with a record per position:
+// the state, the policy of the search over legal actions and the result for the player to move
+
+const int MAX_PLIES = 1000;
+
+struct Options
+{
+    string game = "TicTacToe", search = "mcts:200", prefix = "selfplay";
+    long long games = 1000;
+    int threads = 1;
+    unsigned long long shard_records = 1 << 20;
+    int chunk_records = 64;
+    int temperature_plies = 8; // actions are sampled from the policy until then
+    long long seed = 0;
+};
+
+struct SearchSpec
+{
+    string kind;
+    int param;
+
+    SearchSpec(const string& spec)
+    {
+        size_t p = spec.find(':');
+        kind = spec.substr(0, p);
+        param = p == string::npos ? 0 : stoi(spec.substr(p + 1));
+        if (kind == "alphabeta" && param <= 0) param = 2;
+        if (kind == "mcts" && param <= 0) param = 200;
+    }
+
+    bool valid() const { return kind == "random" || kind == "alphabeta" || kind == "mcts"; }
+};
+
+template <class state_t>
+void mcts_policy(const state_t& state, int simulations, mt19937_64& mt,
+                 const vector<int>& actions, vector<float> *policy)
+{
+    MCTS<state_t> mcts(1.0f, 300, 1 << 20, mt());
+    mcts.search(state, simulations);
+    vector<int> visits = mcts.visits(state);
+    for (size_t i = 0; i < actions.size(); i++) (*policy)[i] = visits[actions[i]];
+}
+
+template <>
+void mcts_policy(const Geister::State& state, int simulations, mt19937_64& mt,
+                 const vector<int>& actions, vector<float> *policy)
+{
+    // hidden colors are sampled instead of read from the state
+    Geister::ISMCTS search;
+    vector<int> visits = search.search(state, simulations, 1, mt());
+    for (size_t i = 0; i < actions.size(); i++) (*policy)[i] = visits[actions[i]];
+}
+
+template <class state_t>
+void search_policy(const SearchSpec& spec, const state_t& state, mt19937_64& mt,
+                   const vector<int>& actions, vector<float> *policy)
+{
+    // a distribution over legal actions
+    policy->assign(actions.size(), 1);
+    if (spec.kind == "alphabeta") {
+        vector<int> best = alpha_beta_search(state, spec.param).first;
+        for (size_t i = 0; i < actions.size(); i++) {
+            (*policy)[i] = find(best.begin(), best.end(), actions[i]) != best.end() ? 1 : 0;
+        }
+    } else if (spec.kind == "mcts") {
+        mcts_policy(state, spec.param, mt, actions, policy);
+    }
+    float sum = accumulate(policy->begin(), policy->end(), 0.0f);
+    for (float& p : *policy) p = sum > 0 ? p / sum : 1.0f / actions.size();
+}
+
+int choose(const vector<float>& policy, bool sample, mt19937_64& mt)
+{
+    // an index of the policy; the best ones are chosen at random after the temperature plies
+    if (sample) {
+        discrete_distribution<int> dist(policy.begin(), policy.end());
+        return dist(mt);
+    }
+    float best = *max_element(policy.begin(), policy.end());
+    vector<int> candidates;
+    for (int i = 0; i < int(policy.size()); i++) {
+        if (policy[i] >= best) candidates.push_back(i);
+    }
+    return candidates[mt() % candidates.size()];
+}
+
+template <class state_t>
+void play_game(const Options& opt, const SearchSpec& spec, long long index, vector<string> *records)
+{
+    mt19937_64 mt(opt.seed * 1000003 + index);
+    state_t state;
+    clear_state(state, mt() & 0x7fffffff);
+
+    vector<int> colors;
+    vector<vector<int>> actions_list;
+    vector<vector<float>> policies;
+    vector<state_t> states;
+    for (int ply = 0; ply < MAX_PLIES && !state.terminal(); ply++) {
+        vector<int> actions = state.legal_actions();
+        if (actions.empty()) break;
+        vector<float> policy;
+        search_policy(spec, state, mt, actions, &policy);
+        states.push_back(state);
+        colors.push_back(state.color_);
+        int i = choose(policy, ply < opt.temperature_plies, mt);
+        actions_list.push_back(actions);
+        policies.push_back(policy);
+        state.play(actions[i]);
+        if (!state.terminal()) state.chance(int(mt() >> 33));
+    }
+
+    float r = state.terminal() ? state.reward(false) : 0;
+    records->resize(states.size());
+    for (size_t k = 0; k < states.size(); k++) {
+        Shard::encode_record(states[k], actions_list[k], policies[k], colors[k] == BLACK ? r : -r, &(*records)[k]);
+    }
+}
+
+template <class state_t>
+int run_selfplay(const Options& opt)
+{
+    SearchSpec spec(opt.search);
+    if (!spec.valid()) {
+        cerr << "unknown search " << opt.search << endl;
+        return 1;
+    }
+
+    struct Output
+    {
+        Shard::Writer writer_;
+        int shards_ = 0;
+    };
+    vector<Output> outputs(opt.threads);
+    atomic<long long> games(0), positions(0);
+    atomic<bool> failed(false);
+    mutex mtx;
+    auto start = chrono::steady_clock::now();
+
+    work_stealing_for(opt.games, opt.threads, [&](size_t index, int t) {
+        if (failed) return;
+        vector<string> records;
+        play_game<state_t>(opt, spec, index, &records);
+
+        Output& out = outputs[t];
+        if (!out.writer_.is_open()) {
+            string path = opt.prefix + "-" + to_string(t) + "-" + to_string(out.shards_++) + ".shard";
+            if (!out.writer_.open(path, opt.game, opt.chunk_records)) {
+                failed = true;
+                return;
+            }
+        }
+        for (const string& record : records) {
+            if (!out.writer_.add(record)) failed = true;
+        }
+        if (out.writer_.records() >= opt.shard_records && !out.writer_.close()) failed = true;
+
+        long long g = ++games, p = positions += records.size();
+        if (g % 100 == 0 || g == opt.games) {
+            lock_guard<mutex> lock(mtx);
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << "games " << g << " positions " << p << " ("
+                 << p / max(elapsed, 1e-9) << " positions/sec)" << endl;
+        }
+    });
+    for (Output& out : outputs) {
+        if (!out.writer_.close()) failed = true;
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        cerr << "usage: selfplay <game> [-g games] [-t threads] [-s search] [-o output prefix] "
+             << "[-r records per shard] [-c records per chunk] [-temp plies] [-seed seed]" << endl;
+        return 1;
+    }
+    Options opt;
+    opt.game = argv[1];
+    opt.threads = max(1u, thread::hardware_concurrency());
+    for (int i = 2; i < argc; i++) {
+        string a = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "missing value of " << a << endl;
+            return 1;
+        }
+        if (a == "-g") opt.games = atoll(argv[++i]);
+        else if (a == "-t") opt.threads = max(1, atoi(argv[++i]));
+        else if (a == "-s") opt.search = argv[++i];
+        else if (a == "-o") opt.prefix = argv[++i];
+        else if (a == "-r") opt.shard_records = max(1LL, atoll(argv[++i]));
+        else if (a == "-c") opt.chunk_records = max(1, atoi(argv[++i]));
+        else if (a == "-temp") opt.temperature_plies = atoi(argv[++i]);
+        else if (a == "-seed") opt.seed = atoll(argv[++i]);
+        else {
+            cerr << "unknown option " << a << endl;
+            return 1;
+        }
+    }
+
+    TicTacToe::init();
+    Reversi::init();
+    AnimalShogi::init();
+    Go::init();
+    Geister::init();
+    FlipTicTacToe::init();
+    // searches reach terminal positions often, where waiting for GNU Go would dominate
+    Go::use_gnugo = false;
+
+    if (opt.game == "TicTacToe")     return run_selfplay<TicTacToe::State>(opt);
+    if (opt.game == "Reversi")       return run_selfplay<Reversi::State>(opt);
+    if (opt.game == "AnimalShogi")   return run_selfplay<AnimalShogi::State>(opt);
+    if (opt.game == "Go")            return run_selfplay<Go::State>(opt);
+    if (opt.game == "Geister")       return run_selfplay<Geister::State>(opt);
+    if (opt.game == "FlipTicTacToe") return run_selfplay<FlipTicTacToe::State>(opt);
+    cerr << "unknown game " << opt.game << endl;
+    return 1;
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+// training shards
+// a shard is a header, chunks of records compressed with zlib, then an index of the chunks
+// written at close, so that a reader maps the file and decompresses only the chunks it needs
+// chunk (uncompressed): uint32 offsets of the records (records + 1) | records
+// record: state (serialize() of the game) | policy actions | policy probabilities | value
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "util.hpp"
+
+using namespace std;
+
+namespace Shard
+{
+    static constexpr const char *MAGIC = "GISHRD02";
+    static constexpr unsigned long long MAX_RATIO = 1032; // of deflate
+
+    struct Header
+    {
+        char magic_[8];
+        char game_[24];
+        unsigned long long chunks_;
+        unsigned long long records_;
+        unsigned long long index_offset_;
+    };
+
+    struct ChunkEntry
+    {
+        unsigned long long offset_;
+        unsigned long long compressed_size_;
+        unsigned long long raw_size_;
+        unsigned long long first_record_;
+    };
+
+    template <class state_t>
+    void encode_record(const state_t& state, const vector<int>& actions,
+                       const vector<float>& policy, float value, string *record)
+    {
+        BinaryWriter w;
+        state.serialize(&w);
+        w.write_as<int>(actions);
+        w.write_as<float>(policy);
+        w.write(value);
+        record->swap(w.data_);
+    }
+
+    template <class state_t>
+    bool decode_record(const string& record, state_t *state, vector<int> *actions,
+                       vector<float> *policy, float *value)
+    {
+        BinaryReader r(record);
+        return state->deserialize(&r)
+            && r.read_as<int>(actions)
+            && r.read_as<float>(policy)
+            && actions->size() == policy->size()
+            && r.read(value)
+            && r.done();
+    }
+
+    static bool write_all(int fd, const char *data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    struct Writer
+    {
+        int fd_;
+        Header header_;
+        vector<ChunkEntry> index_;
+        string chunk_;
+        vector<uint32_t> offsets_;
+        size_t chunk_records_;
+        int level_;
+
+        Writer(): fd_(-1), chunk_records_(64), level_(6) {}
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+        ~Writer() { close(); }
+
+        bool open(const string& path, const string& game, size_t chunk_records = 64, int level = 6)
+        {
+            close();
+            fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd_ < 0) {
+                std::perror("failed to create shard file.\n");
+                return false;
+            }
+            memset(&header_, 0, sizeof(Header));
+            memcpy(header_.magic_, MAGIC, 8);
+            strncpy(header_.game_, game.c_str(), sizeof(header_.game_) - 1);
+            header_.index_offset_ = sizeof(Header);
+            index_.clear();
+            chunk_.clear();
+            offsets_.assign(1, 0);
+            chunk_records_ = max<size_t>(1, chunk_records);
+            level_ = level;
+            // the header is rewritten at close
+            return write_all(fd_, (const char*)&header_, sizeof(Header));
+        }
+
+        bool is_open() const { return fd_ >= 0; }
+
+        unsigned long long records() const
+        {
+            return header_.records_ + offsets_.size() - 1;
+        }
+
+        bool add(const string& record)
+        {
+            chunk_ += record;
+            offsets_.push_back(chunk_.size());
+            return offsets_.size() - 1 < chunk_records_ || flush();
+        }
+
+        bool flush()
+        {
+            // compress the records added since the last chunk
+            size_t n = offsets_.size() - 1;
+            if (fd_ < 0 || n == 0) return fd_ >= 0;
+            string raw((const char*)offsets_.data(), sizeof(uint32_t) * offsets_.size());
+            raw += chunk_;
+            uLongf size = compressBound(raw.size());
+            string compressed(size, '\0');
+            if (compress2((Bytef*)&compressed[0], &size, (const Bytef*)raw.data(), raw.size(), level_) != Z_OK
+                || !write_all(fd_, compressed.data(), size)) {
+                std::perror("failed to write shard chunk.\n");
+                return false;
+            }
+            index_.push_back(ChunkEntry{header_.index_offset_, size, raw.size(), header_.records_});
+            header_.index_offset_ += size;
+            header_.chunks_ += 1;
+            header_.records_ += n;
+            chunk_.clear();
+            offsets_.assign(1, 0);
+            return true;
+        }
+
+        bool close()
+        {
+            if (fd_ < 0) return true;
+            bool ok = flush()
+                && write_all(fd_, (const char*)index_.data(), sizeof(ChunkEntry) * index_.size())
+                && pwrite(fd_, &header_, sizeof(Header), 0) == (ssize_t)sizeof(Header);
+            if (!ok) std::perror("failed to close shard file.\n");
+            ok = ::close(fd_) == 0 && ok;
+            fd_ = -1;
+            return ok;
+        }
+    };
+
+    struct Reader
+    {
+        const Header *header_;
+        const ChunkEntry *index_;
+        void *map_;
+        size_t map_size_;
+
+        Reader(): header_(nullptr), index_(nullptr), map_(nullptr), map_size_(0) {}
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        ~Reader() { close(); }
+
+        bool open(const string& path)
+        {
+            close();
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Header)) {
+                ::close(fd);
+                return false;
+            }
+            void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED) {
+                std::perror("failed to map shard.\n");
+                return false;
+            }
+            map_ = map;
+            map_size_ = st.st_size;
+
+            header_ = (const Header*)map_;
+            if (strncmp(header_->magic_, MAGIC, 8) != 0
+                || header_->index_offset_ < sizeof(Header) || header_->index_offset_ > map_size_
+                || header_->chunks_ != (map_size_ - header_->index_offset_) / sizeof(ChunkEntry)
+                || header_->index_offset_ + sizeof(ChunkEntry) * header_->chunks_ != map_size_) {
+                // unfinished shards have no index
+                cerr << "invalid shard " << path << endl;
+                close();
+                return false;
+            }
+            index_ = (const ChunkEntry*)((const char*)map_ + header_->index_offset_);
+            return true;
+        }
+
+        void close()
+        {
+            if (map_ != nullptr) munmap(map_, map_size_);
+            map_ = nullptr;
+            header_ = nullptr;
+            index_ = nullptr;
+        }
+
+        bool loaded() const { return header_ != nullptr; }
+
+        string game() const { return string(header_->game_, strnlen(header_->game_, sizeof(header_->game_))); }
+        unsigned long long chunks() const { return header_->chunks_; }
+        unsigned long long records() const { return header_->records_; }
+
+        size_t chunk_of(unsigned long long record) const
+        {
+            // the chunk holding a record index
+            size_t lo = 0, hi = header_->chunks_;
+            while (hi - lo > 1) {
+                size_t mid = (lo + hi) / 2;
+                if (index_[mid].first_record_ <= record) lo = mid;
+                else hi = mid;
+            }
+            return lo;
+        }
+
+        bool read_chunk(size_t c, string *raw) const
+        {
+            // the stored sizes are checked before anything is allocated
+            const ChunkEntry& e = index_[c];
+            if (e.offset_ < sizeof(Header) || e.offset_ > header_->index_offset_
+                || e.compressed_size_ > header_->index_offset_ - e.offset_
+                || e.raw_size_ > e.compressed_size_ * MAX_RATIO) return false;
+            raw->resize(e.raw_size_);
+            uLongf size = e.raw_size_;
+            return uncompress((Bytef*)&(*raw)[0], &size,
+                              (const Bytef*)map_ + e.offset_, e.compressed_size_) == Z_OK
+                && size == e.raw_size_;
+        }
+
+        static bool record_in_chunk(const string& raw, size_t records, size_t i, string *record)
+        {
+            // i-th record of a decompressed chunk
+            if (i >= records || records >= raw.size() / sizeof(uint32_t)) return false;
+            size_t base = sizeof(uint32_t) * (records + 1);
+            uint32_t begin, end;
+            memcpy(&begin, raw.data() + sizeof(uint32_t) * i, sizeof(uint32_t));
+            memcpy(&end, raw.data() + sizeof(uint32_t) * (i + 1), sizeof(uint32_t));
+            if (begin > end || base + end > raw.size()) return false;
+            record->assign(raw, base + begin, end - begin);
+            return true;
+        }
+
+        size_t chunk_records(size_t c) const
+        {
+            unsigned long long next = c + 1 < header_->chunks_ ? index_[c + 1].first_record_ : header_->records_;
+            return next - index_[c].first_record_;
+        }
+
+        bool read(unsigned long long record, string *data) const
+        {
+            if (record >= header_->records_) return false;
+            size_t c = chunk_of(record);
+            string raw;
+            return read_chunk(c, &raw)
+                && record_in_chunk(raw, chunk_records(c), record - index_[c].first_record_, data);
+        }
+    };
+}
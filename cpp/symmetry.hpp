@@ -0,0 +1,118 @@
+#pragma once
+
+// symmetries of rectangular boards
+// a symmetry index has bit 0 for mirroring x, bit 1 for mirroring y
+// and bit 2 for swapping x and y (square boards only)
+
+#include <utility>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+inline void transform_xy(int sym, int lx, int ly, int *x, int *y)
+{
+    if (sym & 1) *x = lx - 1 - *x;
+    if (sym & 2) *y = ly - 1 - *y;
+    if (sym & 4) swap(*x, *y);
+}
+
+inline pair<long long, int> smallest_key(const long long *keys, int count)
+{
+    // of the keys of a position seen through each symmetry, the smallest one,
+    // which is the same for all positions symmetric to each other, and its symmetry
+    int best = 0;
+    for (int sym = 1; sym < count; sym++) {
+        if (keys[sym] < keys[best]) best = sym;
+    }
+    return make_pair(keys[best], best);
+}
+
+inline void permute_planes(const float *in, float *out, int channels, int n, const int *perm)
+{
+    // out[perm[pos]] = in[pos] on each plane of n positions
+    for (int c = 0; c < channels; c++) {
+        for (int pos = 0; pos < n; pos++) out[c * n + perm[pos]] = in[c * n + pos];
+    }
+}
+
+inline void gather_planes(const float *in, float *out, int channels, int n, const int *src)
+{
+    // out[pos] = in[src[pos]] on each plane of n positions
+    for (int c = 0; c < channels; c++) {
+        const float *i = in + c * n;
+        float *o = out + c * n;
+        int pos = 0;
+#ifdef __AVX2__
+        for (; pos + 8 <= n; pos += 8) {
+            __m256i index = _mm256_loadu_si256((const __m256i*)(src + pos));
+            _mm256_storeu_ps(o + pos, _mm256_i32gather_ps(i, index, 4));
+        }
+#endif
+        for (; pos < n; pos++) o[pos] = i[src[pos]];
+    }
+}
+
+// permutations of squares and action labels under each symmetry of a game
+// forward tables map an index of a position to the one of the transformed position,
+// sources are their inverses, from which features and policies are gathered
+
+struct SymmetryTables
+{
+    int count_, squares_, action_length_;
+    vector<int> positions_, actions_;
+    vector<int> position_sources_, action_sources_;
+    vector<int> inverse_; // the symmetry undoing each one
+
+    template <class state_t>
+    explicit SymmetryTables(const state_t& s):
+    count_(s.symmetry_count()), squares_(s.size()[0] * s.size()[1]), action_length_(s.action_length()),
+    positions_(count_ * squares_), actions_(count_ * action_length_),
+    position_sources_(count_ * squares_), action_sources_(count_ * action_length_), inverse_(count_)
+    {
+        for (int sym = 0; sym < count_; sym++) {
+            for (int pos = 0; pos < squares_; pos++) {
+                int to = s.transform_position(sym, pos);
+                positions_[sym * squares_ + pos] = to;
+                position_sources_[sym * squares_ + to] = pos;
+            }
+            for (int a = 0; a < action_length_; a++) {
+                int to = s.transform_action(sym, a);
+                actions_[sym * action_length_ + a] = to;
+                action_sources_[sym * action_length_ + to] = a;
+            }
+        }
+        for (int sym = 0; sym < count_; sym++) {
+            for (int other = 0; other < count_; other++) {
+                bool undo = true;
+                for (int pos = 0; pos < squares_ && undo; pos++) {
+                    undo = positions_[other * squares_ + positions_[sym * squares_ + pos]] == pos;
+                }
+                if (undo) inverse_[sym] = other;
+            }
+        }
+    }
+
+    const int *position(int sym) const { return &positions_[sym * squares_]; }
+    const int *action(int sym) const { return &actions_[sym * action_length_]; }
+
+    void transform_feature(int sym, const float *in, float *out, int channels) const
+    {
+        gather_planes(in, out, channels, squares_, &position_sources_[sym * squares_]);
+    }
+
+    void transform_policy(int sym, const float *in, float *out) const
+    {
+        gather_planes(in, out, 1, action_length_, &action_sources_[sym * action_length_]);
+    }
+};
+
+template <class state_t>
+const SymmetryTables& symmetry_tables()
+{
+    // built at the first call, after the game is initialized
+    static const SymmetryTables tables{state_t()};
+    return tables;
+}
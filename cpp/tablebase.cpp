@@ -0,0 +1,222 @@
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+
+#include "util.hpp"
+#include "animalshogi.hpp"
+
+using namespace std;
+using namespace AnimalShogi;
+
+// retrograde analysis of AnimalShogi
+// usage: tablebase [output path] [threads]
+
+const unsigned short UNKNOWN = 0xffff;
+
+double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+vector<unsigned long long> enumerate_positions(int threads)
+{
+    // breadth first search from the initial position
+    auto start = chrono::steady_clock::now();
+    State s;
+    vector<unsigned long long> visited, frontier = {Tablebase::encode(s)};
+    visited = frontier;
+
+    for (int depth = 0; !frontier.empty(); depth++) {
+        vector<vector<unsigned long long>> children(threads);
+        parallel_for(frontier.size(), threads, [&](size_t begin, size_t end, int t) {
+            State s;
+            auto& c = children[t];
+            for (size_t i = begin; i < end; i++) {
+                Tablebase::decode(frontier[i], &s);
+                if (s.reward() != 0) continue;
+                for (int action : s.legal_actions()) {
+                    s.play(action);
+                    unsigned long long key = Tablebase::encode(s);
+                    if (key != 0) c.push_back(key);
+                    s.undo();
+                }
+            }
+            if (c.size() >= (1 << 24)) {
+                // keep duplicates from piling up
+                sort(c.begin(), c.end());
+                c.erase(unique(c.begin(), c.end()), c.end());
+            }
+        });
+
+        vector<unsigned long long> next;
+        for (auto& c : children) {
+            next.insert(next.end(), c.begin(), c.end());
+            vector<unsigned long long>().swap(c);
+        }
+        sort(next.begin(), next.end());
+        next.erase(unique(next.begin(), next.end()), next.end());
+        next.erase(remove_if(next.begin(), next.end(), [&](unsigned long long key) {
+            return binary_search(visited.begin(), visited.end(), key);
+        }), next.end());
+        next.shrink_to_fit();
+
+        size_t mid = visited.size();
+        visited.insert(visited.end(), next.begin(), next.end());
+        inplace_merge(visited.begin(), visited.begin() + mid, visited.end());
+        frontier.swap(next);
+
+        cerr << "depth " << depth << " frontier " << frontier.size()
+             << " total " << visited.size() << " (" << elapsed(start) << " sec)" << endl;
+    }
+    return visited;
+}
+
+vector<unsigned short> solve(const vector<unsigned long long>& keys, int threads)
+{
+    // values fixed at pass p are exactly p plies from the end of the game
+    auto start = chrono::steady_clock::now();
+    const size_t n = keys.size();
+    vector<atomic<unsigned short>> values(n);
+    for (auto& v : values) v.store(UNKNOWN, memory_order_relaxed);
+
+    for (int pass = 0; ; pass++) {
+        atomic<size_t> solved(0);
+        parallel_for(n, threads, [&](size_t begin, size_t end, int) {
+            State s;
+            size_t cnt = 0;
+            for (size_t i = begin; i < end; i++) {
+                if (values[i].load(memory_order_relaxed) != UNKNOWN) continue;
+                Tablebase::decode(keys[i], &s);
+                auto actions = s.legal_actions();
+
+                if (pass == 0) {
+                    float r = s.reward();
+                    int result = r > 0 ? Tablebase::WIN : Tablebase::LOSS;
+                    if (r != 0 || actions.empty()) {
+                        values[i].store(Tablebase::make_value(result, 0), memory_order_relaxed);
+                        cnt++;
+                    }
+                    continue;
+                }
+
+                bool win = false, all_win = true;
+                int max_dtm = 0;
+                for (int action : actions) {
+                    s.play(action);
+                    unsigned long long key = Tablebase::encode(s);
+                    s.undo();
+                    int result = Tablebase::LOSS, dtm = 0; // lion captured
+                    if (key != 0) {
+                        size_t j = lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+                        unsigned short v = j < n && keys[j] == key ? values[j].load(memory_order_relaxed) : UNKNOWN;
+                        if (v == UNKNOWN || Tablebase::value2dtm(v) >= pass) {
+                            all_win = false;
+                            continue;
+                        }
+                        result = Tablebase::value2result(v);
+                        dtm = Tablebase::value2dtm(v);
+                    }
+                    if (result == Tablebase::LOSS) {
+                        win = true;
+                        break;
+                    }
+                    if (result == Tablebase::WIN) max_dtm = max(max_dtm, dtm);
+                    else all_win = false;
+                }
+
+                if (win) {
+                    values[i].store(Tablebase::make_value(Tablebase::WIN, pass), memory_order_relaxed);
+                    cnt++;
+                } else if (all_win && max_dtm == pass - 1) {
+                    values[i].store(Tablebase::make_value(Tablebase::LOSS, pass), memory_order_relaxed);
+                    cnt++;
+                }
+            }
+            solved += cnt;
+        });
+
+        cerr << "pass " << pass << " solved " << solved << " (" << elapsed(start) << " sec)" << endl;
+        if (pass > 0 && solved == 0) break;
+    }
+
+    // the rest can be held forever
+    vector<unsigned short> result(n);
+    for (size_t i = 0; i < n; i++) {
+        unsigned short v = values[i].load(memory_order_relaxed);
+        result[i] = v == UNKNOWN ? Tablebase::make_value(Tablebase::DRAW, 0) : v;
+    }
+    return result;
+}
+
+bool write_table(const string& path,
+                 const vector<unsigned long long>& keys,
+                 const vector<unsigned short>& values)
+{
+    const size_t n = keys.size();
+    int bits = 1;
+    while ((4ULL << bits) < n) bits++; // about 4 to 8 entries per bucket
+
+    vector<unsigned long long> buckets((1ULL << bits) + 1, 0);
+    for (unsigned long long key : keys) buckets[Tablebase::bucket(key, bits) + 1]++;
+    for (size_t b = 0; b + 1 < buckets.size(); b++) buckets[b + 1] += buckets[b];
+
+    size_t size = sizeof(Tablebase::Header)
+                + sizeof(unsigned long long) * buckets.size()
+                + (sizeof(unsigned long long) + sizeof(unsigned short)) * n;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        std::perror("failed to create tablebase file.\n");
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::perror("failed to map tablebase file.\n");
+        return false;
+    }
+
+    auto header = (Tablebase::Header*)map;
+    memset(header, 0, sizeof(Tablebase::Header));
+    memcpy(header->magic_, Tablebase::MAGIC, 8);
+    header->size_ = n;
+    header->bucket_bits_ = bits;
+    auto file_buckets = (unsigned long long*)(header + 1);
+    memcpy(file_buckets, buckets.data(), sizeof(unsigned long long) * buckets.size());
+    auto file_keys = file_buckets + buckets.size();
+    auto file_values = (unsigned short*)(file_keys + n);
+
+    // scattering sorted keys keeps each bucket sorted
+    for (size_t i = 0; i < n; i++) {
+        size_t j = buckets[Tablebase::bucket(keys[i], bits)]++;
+        file_keys[j] = keys[i];
+        file_values[j] = values[i];
+    }
+    return munmap(map, size) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    string path = argc > 1 ? argv[1] : "./animalshogi.tb";
+    int threads = argc > 2 ? atoi(argv[2]) : max(1u, thread::hardware_concurrency());
+
+    AnimalShogi::init();
+    auto keys = enumerate_positions(threads);
+    auto values = solve(keys, threads);
+
+    array<size_t, 3> counts = {0, 0, 0};
+    for (auto v : values) counts[Tablebase::value2result(v)]++;
+    cerr << "draw " << counts[Tablebase::DRAW]
+         << " win " << counts[Tablebase::WIN]
+         << " loss " << counts[Tablebase::LOSS] << endl;
+
+    State s;
+    size_t i = lower_bound(keys.begin(), keys.end(), Tablebase::encode(s)) - keys.begin();
+    cerr << "initial position: result " << Tablebase::value2result(values[i])
+         << " dtm " << Tablebase::value2dtm(values[i]) << endl;
+
+    if (!write_table(path, keys, values)) return 1;
+    cerr << "wrote " << path << endl;
+    return 0;
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <random>
+#include <type_traits>
+
 #include "util.hpp"
 #include "boardgame.hpp"
+#include "symmetry.hpp"
 #include "search.hpp"
 
 using namespace std;
@@ -12,39 +16,126 @@ namespace TicTacToe
     const string Y = "123";
     const string C = "OX.";
 
-    inline void init() {}
+    constexpr int L = 3;
+    constexpr int B = L * L;
+
+    // 9-bit masks of the 8 lines (bit index = y * L + x)
+    const int LINE_MASK[8] = {
+        0007, 0070, 0700, // rows
+        0111, 0222, 0444, // columns
+        0421, 0124,       // diagonals
+    };
+
+    long long STONE_KEY[B][2];
+    int SYMMETRY_POSITION[8][B]; // square each symmetry moves a square to
+
+    inline void init()
+    {
+        mt19937_64 mt(0);
+        for (int pos = 0; pos < B; pos++) {
+            STONE_KEY[pos][0] = mt();
+            STONE_KEY[pos][1] = mt();
+        }
+        for (int sym = 0; sym < 8; sym++) {
+            for (int pos = 0; pos < B; pos++) {
+                int x = pos % L, y = pos / L;
+                transform_xy(sym, L, L, &x, &y);
+                SYMMETRY_POSITION[sym][pos] = y * L + x;
+            }
+        }
+    }
+
+    inline int count_lines(int stones)
+    {
+        int cnt = 0;
+        for (int mask : LINE_MASK) cnt += (stones & mask) == mask ? 1 : 0;
+        return cnt;
+    }
 
     struct State
     {
-        const int L_ = 3;
-        vector<int> board_;
-        int color_;
-        int win_color_;
-        vector<int> record_;
+        array<uint16_t, 2> stones_; // occupancy mask of each color
+        int8_t color_;
+        int8_t win_color_;
+        FixedVector<int8_t, B> record_;
+        array<long long, 8> symmetric_keys_; // Zobrist keys of the board seen through each symmetry
+
+        using Position = State; // already plain memory
 
         State()
         {
-            board_.resize(L_ * L_);
             clear();
         }
 
-        State(const State& s):
-        board_(s.board_),
-        color_(s.color_),
-        win_color_(s.win_color_),
-        record_(s.record_) {}
-
         array<int, 2> size() const
         {
-            return {L_, L_};
+            return {L, L};
+        }
+
+        Position position() const
+        {
+            return *this;
+        }
+
+        bool set_position(const Position& p)
+        {
+            if (!p.valid()) return false;
+            *this = p;
+            reset_symmetric_keys();
+            return true;
+        }
+
+        bool valid() const
+        {
+            // stones on distinct squares, colours and record actions in range
+            if (stones_[0] >> B || stones_[1] >> B || (stones_[0] & stones_[1])) return false;
+            if (color_ != BLACK && color_ != WHITE) return false;
+            if (win_color_ != BLACK && win_color_ != WHITE && win_color_ != EMPTY) return false;
+            if (record_.size() > record_.capacity()) return false;
+            for (int action : record_) {
+                if (action < 0 || action >= B) return false;
+            }
+            return true;
         }
 
         void clear()
         {
-            fill(board_.begin(), board_.end(), EMPTY);
+            stones_.fill(0);
             color_ = BLACK;
             win_color_ = EMPTY;
             record_.clear();
+            symmetric_keys_.fill(0);
+        }
+
+        void serialize(BinaryWriter *w) const
+        {
+            w->write(stones_);
+            w->write(color_);
+            w->write(win_color_);
+            w->write_as<int8_t>(record_);
+        }
+
+        bool deserialize(BinaryReader *r)
+        {
+            if (!r->read(&stones_) || !r->read(&color_) || !r->read(&win_color_)
+                || !r->read_as<int8_t>(&record_) || !valid()) return false;
+            reset_symmetric_keys();
+            return true;
+        }
+
+        void toggle_stone_key(int pos, int color)
+        {
+            for (int sym = 0; sym < 8; sym++) symmetric_keys_[sym] ^= STONE_KEY[SYMMETRY_POSITION[sym][pos]][color];
+        }
+
+        void reset_symmetric_keys()
+        {
+            symmetric_keys_.fill(0);
+            for (int c = 0; c < 2; c++) {
+                for (int pos = 0; pos < B; pos++) {
+                    if (stones_[c] >> pos & 1) toggle_stone_key(pos, c);
+                }
+            }
         }
 
         string action2str(int action) const
@@ -81,12 +172,12 @@ namespace TicTacToe
         {
             ostringstream oss;
             oss << "  ";
-            for (int x = 0; x < L_; x++) oss << X[x];
+            for (int x = 0; x < L; x++) oss << X[x];
             oss << endl;
-            for (int y = 0; y < L_; y++) {
+            for (int y = 0; y < L; y++) {
                 oss << Y[y] << " ";
-                for (int x = 0; x < L_; x++) {
-                    oss << C[board_[xy2action(x, y)]];
+                for (int x = 0; x < L; x++) {
+                    oss << C[board(xy2action(x, y))];
                 }
                 oss << endl;
             }
@@ -99,25 +190,11 @@ namespace TicTacToe
         void play(int action)
         {
             assert(legal(action));
-            board_[action] = color_;
-            int ax = action2x(action), ay = action2y(action);
+            stones_[color_] |= 1 << action;
+            toggle_stone_key(action, color_);
 
             // winning check
-            int xsum = 0, ysum = 0;
-            for (int y = 0; y < L_; y++) xsum += board_[xy2action(ax, y)] == color_ ? 1 : 0;
-            for (int x = 0; x < L_; x++) ysum += board_[xy2action(x, ay)] == color_ ? 1 : 0;
-            if (xsum == L_ || ysum == L_) win_color_ = color_;
-
-            if (ax == ay) {
-                int diagsum = 0;
-                for (int x = 0; x < L_; x++) diagsum += board_[xy2action(x, x)] == color_ ? 1 : 0;
-                if (diagsum == L_) win_color_ = color_;
-            }
-            if (ax == L_ - 1 - ay) {
-                int diagsum = 0;
-                for (int x = 0; x < L_; x++) diagsum += board_[xy2action(x, L_ - 1 - x)] == color_ ? 1 : 0;
-                if (diagsum == L_) win_color_ = color_;
-            }
+            if (count_lines(stones_[color_]) > 0) win_color_ = color_;
 
             color_ = opponent(color_);
             record_.push_back(action);
@@ -129,9 +206,10 @@ namespace TicTacToe
         {
             assert(!record_.empty());
             int action = record_.back();
-            board_[action] = EMPTY;
-            win_color_ = EMPTY;
             color_ = opponent(color_);
+            stones_[color_] &= ~(1 << action);
+            toggle_stone_key(action, color_);
+            win_color_ = EMPTY;
             record_.pop_back();
         }
 
@@ -142,9 +220,23 @@ namespace TicTacToe
             for (const string& s : ss) play(str2action(s));
         }
 
+        long long key() const
+        {
+            // exact: stones of both colors and the color to move
+            return (long long)(stones_[0] | stones_[1] << B) << 1 | color_;
+        }
+
+        pair<long long, int> canonical_hash() const
+        {
+            // a key shared by symmetric positions and the symmetry to the canonical one
+            array<long long, 8> keys;
+            for (int sym = 0; sym < 8; sym++) keys[sym] = symmetric_keys_[sym] ^ color_;
+            return smallest_key(keys.data(), 8);
+        }
+
         bool terminal() const
         {
-            return win_color_ != EMPTY || int(record_.size()) == L_ * L_;
+            return win_color_ != EMPTY || int(record_.size()) == B;
         }
 
         float reward(bool subjective = true) const
@@ -155,14 +247,14 @@ namespace TicTacToe
 
         bool legal(int action) const
         {
-            return action >= 0 && action < L_ * L_ && board_[action] == EMPTY;
+            return action >= 0 && action < B && !((stones_[0] | stones_[1]) >> action & 1);
         }
 
         vector<int> legal_actions() const
         {
             vector<int> actions;
-            for (int i = 0; i < L_ * L_; i++) {
-                if (legal(i)) actions.push_back(i);
+            for (int empty = ~(stones_[0] | stones_[1]) & ((1 << B) - 1); empty; empty &= empty - 1) {
+                actions.push_back(bsf(empty));
             }
             return actions;
         }
@@ -175,32 +267,70 @@ namespace TicTacToe
 
         int action_length() const
         {
-            return L_ * L_;
+            return B;
+        }
+
+        int symmetry_count() const
+        {
+            return 8;
+        }
+
+        int transform_position(int sym, int pos) const
+        {
+            int x = action2x(pos), y = action2y(pos);
+            transform_xy(sym, L, L, &x, &y);
+            return xy2action(x, y);
+        }
+
+        int transform_action(int sym, int action) const
+        {
+            return transform_position(sym, action);
+        }
+
+        int feature_channels() const
+        {
+            return 2;
         }
 
         vector<float> feature() const
         {
-            vector<float> f(2 * L_ * L_, 0.0f);
-            for (int pos = 0; pos < L_ * L_; pos++) {
-                if (board_[pos] == color_)           f[pos          ] = 1;
-                if (board_[pos] == opponent(color_)) f[pos + L_ * L_] = 1;
-            }
+            vector<float> f(feature_channels() * B);
+            feature_into(f.data());
             return f;
         }
 
+        void feature_into(float *f) const
+        {
+            // feature_channels() planes written into f
+            fill(f, f + 2 * B, 0.0f);
+            for (int pos = 0; pos < B; pos++) {
+                if (stones_[color_]           >> pos & 1) f[pos    ] = 1;
+                if (stones_[opponent(color_)] >> pos & 1) f[pos + B] = 1;
+            }
+        }
+
+        int board(int pos) const
+        {
+            if (stones_[BLACK] >> pos & 1) return BLACK;
+            if (stones_[WHITE] >> pos & 1) return WHITE;
+            return EMPTY;
+        }
+
         int action2x(int action) const
         {
-            return action % L_;
+            return action % L;
         }
 
         int action2y(int action) const
         {
-            return action / L_;
+            return action / L;
         }
 
         int xy2action(int x, int y) const
         {
-            return y * L_ + x;
+            return y * L + x;
         }
     };
+
+    static_assert(is_trivially_copyable<State>::value, "TicTacToe::State must be plain memory");
 }
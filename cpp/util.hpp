@@ -1,6 +1,11 @@
 #pragma once
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <cerrno>
 #include <cstdio>
 #include <cassert>
 #include <cstring>
@@ -13,6 +18,10 @@
 #include <algorithm>
 #include <numeric>
 #include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 
 static bool contains(const std::string& s, const std::string& t)
 {
@@ -102,6 +111,137 @@ std::ostream& operator <<(std::ostream& ost, const std::pair<T0, T1>& v)
     return ost;
 }
 
+// fixed-capacity vector that can be copied as plain memory
+
+template <class T, std::size_t N>
+struct FixedVector
+{
+    std::array<T, N> data_;
+    int size_;
+
+    FixedVector(): size_(0) {}
+
+    void clear() { size_ = 0; }
+    void push_back(const T& v) { assert(size_ < int(N)); data_[size_++] = v; }
+    void pop_back() { assert(size_ > 0); size_--; }
+    bool empty() const { return size_ == 0; }
+    std::size_t size() const { return size_; }
+    std::size_t capacity() const { return N; }
+
+    T& operator [](std::size_t i) { return data_[i]; }
+    const T& operator [](std::size_t i) const { return data_[i]; }
+    T& back() { return data_[size_ - 1]; }
+    const T& back() const { return data_[size_ - 1]; }
+
+    T* begin() { return data_.data(); }
+    T* end() { return data_.data() + size_; }
+    const T* begin() const { return data_.data(); }
+    const T* end() const { return data_.data() + size_; }
+
+    template <class U>
+    operator std::vector<U>() const { return std::vector<U>(begin(), end()); }
+};
+
+// binary encoding of plain values and containers of them
+
+struct BinaryWriter
+{
+    std::string data_;
+
+    template <class T>
+    void write(const T& v)
+    {
+        data_.append(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    template <class S, class C>
+    void write_as(const C& c)
+    {
+        // the size, then each element converted to S
+        write(uint32_t(c.size()));
+        for (const auto& v : c) write(S(v));
+    }
+};
+
+struct BinaryReader
+{
+    const std::string& data_;
+    std::size_t pos_;
+
+    BinaryReader(const std::string& data): data_(data), pos_(0) {}
+
+    bool done() const { return pos_ == data_.size(); }
+
+    template <class T>
+    bool read(T *v)
+    {
+        if (pos_ + sizeof(T) > data_.size()) return false;
+        std::memcpy(v, data_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return true;
+    }
+
+    template <class S, class T>
+    bool read_as(std::vector<T> *c)
+    {
+        uint32_t n;
+        if (!read(&n) || n > (data_.size() - pos_) / sizeof(S)) return false;
+        c->resize(n);
+        for (uint32_t i = 0; i < n; i++) {
+            S v;
+            read(&v);
+            (*c)[i] = T(v);
+        }
+        return true;
+    }
+
+    template <class S, class T, std::size_t N>
+    bool read_as(std::array<T, N> *c)
+    {
+        uint32_t n;
+        if (!read(&n) || n != N) return false;
+        for (auto& x : *c) {
+            S v;
+            if (!read(&v)) return false;
+            x = T(v);
+        }
+        return true;
+    }
+
+    template <class S, class T, std::size_t N>
+    bool read_as(FixedVector<T, N> *c)
+    {
+        uint32_t n;
+        if (!read(&n) || n > N) return false;
+        c->clear();
+        for (uint32_t i = 0; i < n; i++) {
+            S v;
+            if (!read(&v)) return false;
+            c->push_back(T(v));
+        }
+        return true;
+    }
+};
+
+// bit operation
+
+inline int popcnt(unsigned long long x)
+{
+    return __builtin_popcountll(x);
+}
+
+inline int bsf(unsigned long long x)
+{
+    // index of the lowest set bit (x != 0)
+    return __builtin_ctzll(x);
+}
+
+inline int bsr(unsigned long long x)
+{
+    // index of the highest set bit (x != 0)
+    return 63 - __builtin_clzll(x);
+}
+
 template <class T>
 T sum_of(const std::vector<T>& v)
 {
@@ -114,16 +254,84 @@ T sum_of(const std::array<T, N>& v)
     return std::accumulate(v.begin(), v.end(), T(0));
 }
 
+// f(begin, end, thread index) over dynamically assigned chunks of [0, n)
+
+template <class F>
+void parallel_for(std::size_t n, int threads, const F& f, std::size_t chunk = 1 << 14)
+{
+    if (threads <= 1 || n <= chunk) {
+        if (n > 0) f(0, n, 0);
+        return;
+    }
+    std::atomic<std::size_t> next(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            while (true) {
+                std::size_t begin = next.fetch_add(chunk);
+                if (begin >= n) break;
+                f(begin, std::min(n, begin + chunk), t);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+}
+
+// f(task, thread index) for each task of [0, n)
+// each thread starts from its own contiguous range and steals from the others when it runs out,
+// so that tasks of very different lengths (e.g. whole games) keep every thread busy
+
+template <class F>
+void work_stealing_for(std::size_t n, int threads, const F& f)
+{
+    if (threads <= 1) {
+        for (std::size_t i = 0; i < n; i++) f(i, 0);
+        return;
+    }
+    struct Range
+    {
+        std::mutex mutex_;
+        std::size_t begin_, end_;
+    };
+    std::vector<Range> ranges(threads);
+    for (int t = 0; t < threads; t++) {
+        ranges[t].begin_ = n * t / threads;
+        ranges[t].end_ = n * (t + 1) / threads;
+    }
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            while (true) {
+                // the owner takes from the front, thieves take from the back
+                std::size_t task = n;
+                for (int k = 0; k < threads && task == n; k++) {
+                    Range& r = ranges[(t + k) % threads];
+                    std::lock_guard<std::mutex> lock(r.mutex_);
+                    if (r.begin_ < r.end_) task = k == 0 ? r.begin_++ : --r.end_;
+                }
+                if (task == n) break;
+                f(task, t);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+}
+
+// child process connected with pipes
+// reads are buffered and non-blocking with deadlines,
+// and poll_lines() waits on several processes at once
+
 class Process
 {
 public:
-    bool getline(std::string* const line) {
-        line->clear();
-        for (char c; (c = std::fgetc(this->stream_from_child_)) != EOF;) {
-            if (c == '\n') return true;
-            line->push_back(c);
-        }
-        return false;
+    enum { TIMEOUT = -2, CLOSED = -1, FAILURE = 0, SUCCESS = 1 };
+
+    Process(): process_id_(-1), fd_to_child_(-1), fd_from_child_(-1), eof_(false) {}
+    Process(const Process&) = delete;
+    Process& operator =(const Process&) = delete;
+
+    ~Process() {
+        stop();
     }
 
     int start(const char* const file, char *const argv[]) {
@@ -132,12 +340,12 @@ public:
         int pipe_from_child[2];
         int pipe_to_child[2];
 
-        if (pipe(pipe_from_child) < 0) {
+        if (pipe_cloexec(pipe_from_child) < 0) {
             std::perror("failed to create pipe_from_chlid.\n");
             return -1;
         }
 
-        if (pipe(pipe_to_child) < 0) {
+        if (pipe_cloexec(pipe_to_child) < 0) {
             std::perror("failed to create pipe_to_child.\n");
             close(pipe_from_child[kRead]);
             close(pipe_from_child[kWrite]);
@@ -164,32 +372,188 @@ public:
             close(pipe_to_child[kRead]);
             close(pipe_from_child[kWrite]);
 
-            if (execvp(file, argv) < 0) {
-                std::perror("execvp() failed\n");
-                close(pipe_to_child[kRead]);
-                close(pipe_from_child[kWrite]);
-                return -1;
-            }
+            execvp(file, argv);
+            std::perror("execvp() failed\n");
+            _exit(127);
         }
 
-        process_id_ = process_id;
+        close(pipe_to_child[kRead]);
+        close(pipe_from_child[kWrite]);
 
-        stream_to_child_ = fdopen(pipe_to_child[kWrite], "w");
-        stream_from_child_ = fdopen(pipe_from_child[kRead], "r");
+        // a dead child should be an error on write rather than a signal
+        signal(SIGPIPE, SIG_IGN);
 
-        std::setvbuf(stream_to_child_, NULL, _IONBF, 0);
-        std::setvbuf(stream_from_child_, NULL, _IONBF, 0);
+        process_id_ = process_id;
+        fd_to_child_ = pipe_to_child[kWrite];
+        fd_from_child_ = pipe_from_child[kRead];
+        fcntl(fd_from_child_, F_SETFL, fcntl(fd_from_child_, F_GETFL) | O_NONBLOCK);
+        buffer_.clear();
+        eof_ = false;
 
         return process_id;
     }
 
-    void printline(const char* str) {
-        std::fprintf(this->stream_to_child_, "%s\n", str);
+    bool printline(const std::string& str) {
+        std::string data = str + "\n";
+        std::size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = write(fd_to_child_, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            written += n;
+        }
+        return true;
+    }
+
+    bool fill() {
+        // reads what is available now; false at the end of output
+        char buf[4096];
+        while (!eof_) {
+            ssize_t n = read(fd_from_child_, buf, sizeof(buf));
+            if (n > 0) {
+                buffer_.append(buf, n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                eof_ = true;
+            }
+        }
+        return !eof_;
+    }
+
+    bool has_line() const {
+        return buffer_.find('\n') != std::string::npos;
+    }
+
+    bool closed() const {
+        return eof_ && !has_line();
+    }
+
+    int readline(std::string* const line, int timeout_ms = -1) {
+        // SUCCESS, TIMEOUT or CLOSED; timeout_ms < 0 waits forever
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (!has_line()) {
+            if (eof_ || fd_from_child_ < 0) return CLOSED;
+            int wait = -1;
+            if (timeout_ms >= 0) {
+                auto rest = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+                wait = std::max(0, int(rest.count()));
+            }
+            pollfd pfd = {fd_from_child_, POLLIN, 0};
+            int r = poll(&pfd, 1, wait);
+            if (r == 0) return TIMEOUT;
+            if (r < 0 && errno != EINTR) return CLOSED;
+            if (r > 0) fill();
+        }
+        std::size_t p = buffer_.find('\n');
+        line->assign(buffer_, 0, p);
+        if (!line->empty() && line->back() == '\r') line->pop_back();
+        buffer_.erase(0, p + 1);
+        return SUCCESS;
+    }
+
+    bool getline(std::string* const line) {
+        return readline(line) == SUCCESS;
+    }
+
+    int request(const std::string& command, std::string* const response, int timeout_ms = -1) {
+        // GTP style exchange; a response starts with "=" (SUCCESS) or "?" (FAILURE)
+        // and ends with an empty line, its text is stored without the mark
+        response->clear();
+        if (!printline(command)) return CLOSED;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        int status = CLOSED;
+        std::string line;
+        while (true) {
+            int rest = -1;
+            if (timeout_ms >= 0) {
+                rest = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                rest = std::max(rest, 0);
+            }
+            int r = readline(&line, rest);
+            if (r != SUCCESS) return r;
+            if (status == CLOSED) {
+                // skip anything before the response
+                if (line.empty() || (line[0] != '=' && line[0] != '?')) continue;
+                status = line[0] == '=' ? SUCCESS : FAILURE;
+                std::size_t p = line.find(' ');
+                response->assign(p == std::string::npos ? "" : line.substr(p + 1));
+            } else if (line.empty()) {
+                return status;
+            } else {
+                *response += "\n" + line;
+            }
+        }
+    }
+
+    void stop(int timeout_ms = 1000) {
+        // closing stdin asks the child to quit; it is killed after the timeout
+        if (fd_to_child_ >= 0) close(fd_to_child_);
+        if (fd_from_child_ >= 0) close(fd_from_child_);
+        fd_to_child_ = fd_from_child_ = -1;
+        if (process_id_ <= 0) return;
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        int sig = SIGTERM;
+        while (waitpid(process_id_, nullptr, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                kill(process_id_, sig);
+                if (sig == SIGKILL) {
+                    waitpid(process_id_, nullptr, 0);
+                    break;
+                }
+                sig = SIGKILL;
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        process_id_ = -1;
     }
 
     pid_t process_id() const { return process_id_; }
+    int fd() const { return fd_from_child_; }
 
 private:
+    static int pipe_cloexec(int fds[2]) {
+        // close-on-exec from creation, so that a child started by another thread
+        // in the meantime does not inherit them
+#ifdef __linux__
+        return pipe2(fds, O_CLOEXEC);
+#else
+        if (pipe(fds) < 0) return -1;
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        return 0;
+#endif
+    }
+
     pid_t process_id_;
-    std::FILE *stream_to_child_, *stream_from_child_;
+    int fd_to_child_, fd_from_child_;
+    std::string buffer_;
+    bool eof_;
 };
+
+inline std::vector<int> poll_lines(const std::vector<Process*>& processes, int timeout_ms = -1)
+{
+    // indices of processes with a line ready after waiting at most timeout_ms;
+    // a process is also reported once when its output ends
+    std::vector<int> ready, waiting;
+    for (int i = 0; i < int(processes.size()); i++) {
+        if (processes[i]->has_line()) ready.push_back(i);
+        else if (!processes[i]->closed() && processes[i]->fd() >= 0) waiting.push_back(i);
+    }
+    if (!ready.empty() || waiting.empty()) return ready;
+
+    std::vector<pollfd> pfds;
+    for (int i : waiting) pfds.push_back(pollfd{processes[i]->fd(), POLLIN, 0});
+    if (poll(pfds.data(), pfds.size(), timeout_ms) <= 0) return ready;
+    for (int k = 0; k < int(waiting.size()); k++) {
+        if (pfds[k].revents == 0) continue;
+        Process *p = processes[waiting[k]];
+        p->fill();
+        if (p->has_line() || p->closed()) ready.push_back(waiting[k]);
+    }
+    return ready;
+}
@@ -13,4 +13,13 @@ for game in classes:
     s = getattr(games, game)()
     print(s)
     print(s.legal_actions())
-    print([s.action2str(a) for a in s.legal_actions()])
\ No newline at end of file
+    print([s.action2str(a) for a in s.legal_actions()])
+# arena smoke run; openings include chance events in FlipTicTacToe
+import subprocess
+
+for game in classes:
+    for players in [['random', 'random'], ['mcts:20', 'random']]:
+        r = subprocess.run(['./arena', game] + players + ['-n', '20', '-t', '2'],
+                           stdout=subprocess.PIPE, universal_newlines=True)
+        assert r.returncode == 0, (game, players, r.returncode)
+        print(r.stdout.splitlines()[-1])